@@ -15,6 +15,8 @@
 
 #include "CairoGauge.hh"
 
+#include <algorithm>
+
 void CairoGauge::draw_background(void) {
   const int width = get_allocation().get_width(), height = get_allocation().get_height(),
             radius = std::min(width, height) / 2;
@@ -57,6 +59,40 @@ void CairoGauge::draw_background(void) {
   context->show_text(_text);
 }
 
+void CairoGauge::select_background(void) {
+  const int width = get_allocation().get_width(), height = get_allocation().get_height();
+  auto i = std::find_if(_backgrounds.begin(), _backgrounds.end(),
+                        [&](const background &b) { return b.width == width && b.height == height; });
+  if (i != _backgrounds.end()) {
+    background b = *i;
+    _backgrounds.erase(i);
+    _backgrounds.push_front(b);
+  } else {
+    draw_background();
+    _backgrounds.push_front(background{width, height, _background});
+    if (_backgrounds.size() > BACKGROUND_CACHE_SIZE)
+      _backgrounds.pop_back();
+  }
+  _background = _backgrounds.front().surface;
+}
+
+Gdk::Rectangle CairoGauge::get_needle_rect(double from, double to) {
+  const int width = get_allocation().get_width(), height = get_allocation().get_height(),
+            radius = std::min(width, height) / 2;
+  // bounding box of the hub and both tips, widened by the hub radius and the line width; then through _transform_matrix
+  const double a = angle_of(from), b = angle_of(to), r = NEEDLE_LENGTH * radius, m = NEEDLE_HUB * radius + 3;
+  double x[2] = {std::min({0.0, r * cos(a), r * cos(b)}) - m, std::max({0.0, r * cos(a), r * cos(b)}) + m},
+         y[2] = {std::min({0.0, -r * sin(a), -r * sin(b)}) - m, std::max({0.0, -r * sin(a), -r * sin(b)}) + m};
+  double x_min = HUGE_VAL, x_max = -HUGE_VAL, y_min = HUGE_VAL, y_max = -HUGE_VAL;
+  for (unsigned i = 0; i < 4; ++i) {
+    double _x = x[i & 1], _y = y[i >> 1];
+    _transform_matrix.transform_point(_x, _y);
+    x_min = std::min(x_min, _x), x_max = std::max(x_max, _x), y_min = std::min(y_min, _y), y_max = std::max(y_max, _y);
+  }
+  return Gdk::Rectangle(std::floor(x_min + width / 2) - 1, std::floor(y_min + height / 2) - 1,
+                        std::ceil(x_max - x_min) + 2, std::ceil(y_max - y_min) + 2);
+}
+
 bool CairoGauge::on_draw(const Cairo::RefPtr<Cairo::Context> &context) {
   const int width = get_allocation().get_width(), height = get_allocation().get_height(),
             radius = std::min(width, height) / 2;
@@ -67,7 +103,7 @@ bool CairoGauge::on_draw(const Cairo::RefPtr<Cairo::Context> &context) {
   context->set_line_cap(Cairo::LINE_CAP_ROUND);
 
   if (!_background)
-    draw_background();
+    select_background();
   context->set_source(_background, -width / 2, -height / 2);
   context->paint();
 
@@ -76,25 +112,33 @@ bool CairoGauge::on_draw(const Cairo::RefPtr<Cairo::Context> &context) {
   context->set_line_width(3);
   context->set_source_rgba(1, 0.2, 0.2, 1);
   context->move_to(0, 0);
-  context->line_to(0.76 * radius * cos(angle), -0.76 * radius * sin(angle));
+  context->line_to(NEEDLE_LENGTH * radius * cos(angle), -NEEDLE_LENGTH * radius * sin(angle));
   context->stroke();
-  context->arc(0, 0, 0.03 * radius, 0, 2 * M_PI);
+  context->arc(0, 0, NEEDLE_HUB * radius, 0, 2 * M_PI);
   context->fill();
+  _painted_value = _value;
 
+  if (_paint_latency && _value_timestamp != std::chrono::steady_clock::time_point()) {
+    _paint_latency->record(_value_timestamp);
+    _value_timestamp = std::chrono::steady_clock::time_point();
+  }
   return TRUE;
 }
 
 void CairoGauge::on_size_allocate(Gtk::Allocation &allocation) {
   Gtk::Widget::on_size_allocate(allocation);
-  if (_background)
-    draw_background();
+  // picked from _backgrounds, or drawn, on the next paint
+  _background = Cairo::RefPtr<Cairo::Surface>();
 }
 
-void CairoGauge::update(void *arg) {
-  auto v = _sample_fn(arg);
-  if (v != _value) {
-    _value = v;
-    get_window()->invalidate_rect(Gdk::Rectangle(0, 0, get_allocation().get_width(), get_allocation().get_height()),
-                                  FALSE);
-  }
+void CairoGauge::update(void *arg, std::chrono::steady_clock::time_point timestamp, uint32_t changed) {
+  if (!(changed & _sample_mask))
+    return;
+  _value = _sample_fn(arg);
+  // travel of the tip of the needle since it was last painted
+  const int radius = std::min(get_allocation().get_width(), get_allocation().get_height()) / 2;
+  if (NEEDLE_LENGTH * radius * std::fabs(angle_of(_value) - angle_of(_painted_value)) < NEEDLE_MIN_TRAVEL)
+    return;
+  _value_timestamp = timestamp;
+  get_window()->invalidate_rect(get_needle_rect(_painted_value, _value), FALSE);
 }
@@ -16,8 +16,13 @@
 #ifndef CAIROGAUGE_HH
 #define CAIROGAUGE_HH
 
+#include "LatencyHistogram.hh"
+
 #include <cairomm/context.h>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <deque>
 #include <functional>
 #include <gtkmm.h>
 #include <string>
@@ -27,17 +32,36 @@ protected:
   // TODO: make this a configurable parameter
   /// The default font size for this widget
   static constexpr unsigned CAIROGAUGE_FONT_SIZE = 14;
+  /// Length of the needle and radius of its hub, relative to the radius of the gauge
+  static constexpr double NEEDLE_LENGTH = 0.76, NEEDLE_HUB = 0.03;
+  /// Changes of the value that move the tip of the needle less than this many pixels are not painted until they add up
+  static constexpr double NEEDLE_MIN_TRAVEL = 1;
+  /// Number of backgrounds kept, for the last allocation sizes; re-layout often goes back to a previous size
+  static constexpr unsigned BACKGROUND_CACHE_SIZE = 4;
 
   typedef std::function<double(void *)> sample_fn_t;
+  struct background {
+    int width, height;
+    Cairo::RefPtr<Cairo::Surface> surface;
+  };
 
   std::string _text;
   sample_fn_t _sample_fn;
-  double _value, _value_max, _tick_step;
+  uint32_t _sample_mask;
+  double _value, _painted_value, _value_max, _tick_step;
   size_t _label_step;
   Cairo::Matrix _transform_matrix;
+  /// Background of the current allocation size, and those of the last sizes, most recently used first
   Cairo::RefPtr<Cairo::Surface> _background;
+  std::deque<background> _backgrounds;
+  LatencyHistogram *_paint_latency;
+  std::chrono::steady_clock::time_point _value_timestamp; /* timestamp of _value if not yet painted */
 
   void draw_background(void);
+  /// Set _background to that of the current allocation size, drawing it if not in _backgrounds
+  void select_background(void);
+  /// Area covered by the needle at @a from and at @a to
+  Gdk::Rectangle get_needle_rect(double from, double to);
 
   bool on_draw(const Cairo::RefPtr<Cairo::Context> &context) override;
   void on_size_allocate(Gtk::Allocation &allocation);
@@ -49,12 +73,13 @@ public:
    * @param _M Maximum value of any sample
    * @param step Draw ticks using @a step increments
    * @param l_step Draw labels each @a l_step ticks
+   * @param mask Bitmask of the inputs that @a fn depends on; see update()
    */
-  CairoGauge(std::string text, sample_fn_t fn, double _M, double step = 0, size_t l_step = 1)
-      : _text(text), _sample_fn(fn), _value(0), _value_max(_M), _tick_step(step), _label_step(l_step),
-        _transform_matrix(Cairo::identity_matrix()) {}
+  CairoGauge(std::string text, sample_fn_t fn, double _M, double step = 0, size_t l_step = 1, uint32_t mask = ~0u)
+      : _text(text), _sample_fn(fn), _sample_mask(mask), _value(0), _painted_value(0), _value_max(_M), _tick_step(step),
+        _label_step(l_step), _transform_matrix(Cairo::identity_matrix()), _paint_latency(nullptr) {}
   CairoGauge(const CairoGauge &_o)
-      : CairoGauge(_o._text, _o._sample_fn, _o._value_max, _o._tick_step, _o._label_step) {}
+      : CairoGauge(_o._text, _o._sample_fn, _o._value_max, _o._tick_step, _o._label_step, _o._sample_mask) {}
   virtual ~CairoGauge() {}
 
   void set_transform_matrix(Cairo::Matrix &_m) {
@@ -62,10 +87,18 @@ public:
     queue_draw();
   }
 
+  /** Record, for each new value, the time from @a timestamp (see update()) to its first paint
+   */
+  void set_paint_latency(LatencyHistogram *h) { _paint_latency = h; }
+
   /** Call the @a fn function (constructor argument) and update gauge with
-   * the returned value.
+   * the returned value.  Only the area of the needle is repainted, and only if it moves by NEEDLE_MIN_TRAVEL pixels.
+   * @param timestamp Time at which the data in @a arg was received
+   * @param changed Bitmask of the inputs that changed since the last call; nothing is done unless any of those in the
+   *     @a mask constructor argument did
    */
-  void update(void *arg);
+  void update(void *arg, std::chrono::steady_clock::time_point timestamp = std::chrono::steady_clock::time_point(),
+              uint32_t changed = ~0u);
 
 protected:
   double angle_of(double value) { return 5 * M_PI_4 - (value / _value_max * 3 * M_PI_2); }
@@ -15,8 +15,26 @@
 
 #include "CairoTSPlot.hh"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
 const Gdk::RGBA CairoTSPlot::RGBA_DEFAULT{"#2e7db3"};
 const Gdk::RGBA CairoTSPlot::RGBA_ALERT{"#cc0d29"};
+constexpr unsigned CairoTSPlot::LABEL_STEPS[];
+
+/// Label for a time @a d ago, e.g. "45s", "12m" or "1h05"
+static std::string format_age(std::chrono::steady_clock::duration d) {
+  auto s = std::chrono::duration_cast<std::chrono::seconds>(d).count();
+  if (s < 120)
+    return std::to_string(s) + "s";
+  if (s < 7200)
+    return std::to_string(s / 60) + "m";
+  char buf[24];
+  std::snprintf(buf, sizeof(buf), "%dh%02d", static_cast<int>(s / 3600), static_cast<int>(s / 60 % 60));
+  return buf;
+}
 
 void CairoTSPlot::draw_background(void) {
   const int width = get_allocation().get_width(), height = get_allocation().get_height(), y_0 = height - MARGIN_BOTTOM;
@@ -70,11 +88,143 @@ void CairoTSPlot::draw_background(void) {
   context->show_text(_text);
 }
 
-bool CairoTSPlot::on_draw(const Cairo::RefPtr<Cairo::Context> &context) {
+bool CairoTSPlot::decimate(int width) {
+  typedef TSHistory::clock clock;
+  const auto window = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(_window));
+  const auto period = std::max<clock::rep>(window.count() / std::max(width, 1), 1);
+  // the coarsest level whose rollups are not wider than a column, or a coarser one if it does not hold the whole span
+  unsigned level = 0;
+  for (unsigned l = 1; l <= TSHistory::LEVELS; ++l)
+    if (clock::duration(std::chrono::seconds(TSHistory::level_period(l))).count() <= period)
+      level = l;
+  while (level < TSHistory::LEVELS && !_history->holds(level, window))
+    ++level;
+
+  // columns are aligned on multiples of the period, so that they do not change once complete
+  const uint64_t head = _history->get_head(level), first = _history->get_first(level);
+  bool ret = (period == _column_period && level == _column_level);
+  if (!ret)
+    _columns.clear(), _column_period = period, _column_level = level, _columns_head = first;
+
+  // the last rollup may have changed since; merging it again is harmless, as its minimum and maximum only widen
+  uint64_t n = (level && _columns_head > first) ? _columns_head - 1 : std::max(_columns_head, first);
+  for (; n < head; ++n) {
+    TSHistory::entry e;
+    if (!_history->read(_channel, n, level, e)) {
+      // overwritten: skip it; being updated: read it on the next paint, rather than wait for the reader thread
+      if (n < _history->get_first(level))
+        continue;
+      break;
+    }
+    if (std::isnan(e.max))
+      continue;
+    int64_t x = e.time.time_since_epoch().count() / _column_period;
+    if (_columns.empty() || _columns.back().x != x || _columns.back().is_alerted != e.is_alerted) {
+      _columns.push_back(column{x, e.mean, e.min, e.max, e.mean, TRUE, e.is_alerted});
+      continue;
+    }
+    column &c = _columns.back();
+    if (e.min < c.min)
+      c.min = e.min, c.min_first = FALSE;
+    if (e.max > c.max)
+      c.max = e.max, c.min_first = TRUE;
+    c.last = e.mean;
+  }
+  _columns_head = n;
+  while (!_columns.empty() && _columns.back().x - _columns.front().x > width)
+    _columns.pop_front();
+  return ret;
+}
+
+void CairoTSPlot::draw_trace(const Cairo::RefPtr<Cairo::Context> &context, int64_t x_from) {
   const int width = get_allocation().get_width(), height = get_allocation().get_height(),
             y_0 = (height / 2) - MARGIN_BOTTOM, x_offset = (width / 2) - MARGIN_RIGHT;
-  const double x_step = (width - MARGIN_LEFT - MARGIN_RIGHT) / static_cast<double>(NUM_POINTS);
-  ssize_t data_tail = _data_head.load() - 1, is_alert_region;
+  const int64_t x_newest = _columns.back().x;
+  double last_x = 0, last_y = HUGE_VAL;
+  auto point = [&](double x, float value) {
+    double y = y_0 - yoffset_of(value);
+    if (x != last_x || y != last_y)
+      context->line_to(last_x = x, last_y = y);
+  };
+
+  // the values of a column are drawn last to first
+  bool is_alert_region = _columns.back().is_alerted;
+  Gdk::Cairo::set_source_rgba(context, is_alert_region ? RGBA_ALERT : RGBA_DEFAULT);
+  context->set_line_width(2);
+  context->move_to(last_x = x_offset, last_y = y_0 - yoffset_of(_columns.back().last));
+  for (auto i = _columns.rbegin(); i != _columns.rend() && i->x >= x_from; ++i) {
+    if (is_alert_region != i->is_alerted) { // set a different color for alerted region
+      context->stroke();
+      Gdk::Cairo::set_source_rgba(context, (is_alert_region = i->is_alerted) ? RGBA_ALERT : RGBA_DEFAULT);
+      context->move_to(last_x, last_y);
+    }
+    double x = x_offset - (x_newest - i->x);
+    point(x, i->last);
+    point(x, i->min_first ? i->max : i->min);
+    point(x, i->min_first ? i->min : i->max);
+    point(x, i->first);
+  }
+  context->stroke();
+}
+
+void CairoTSPlot::update_trace() {
+  const int width = get_allocation().get_width(), height = get_allocation().get_height(),
+            plot_width = width - MARGIN_LEFT - MARGIN_RIGHT;
+  const int64_t x_newest = _columns.back().x, shift = x_newest - _trace_x;
+  if (!_trace) {
+    _trace = get_window()->create_similar_surface(Cairo::CONTENT_COLOR_ALPHA, width, height);
+    _trace_back = get_window()->create_similar_surface(Cairo::CONTENT_COLOR_ALPHA, width, height);
+    _trace_valid = FALSE;
+  }
+
+  auto context = Cairo::Context::create(_trace_back);
+  context->set_antialias(Cairo::ANTIALIAS_SUBPIXEL);
+  context->set_line_cap(Cairo::LINE_CAP_ROUND);
+  context->set_line_join(Cairo::LINE_JOIN_ROUND);
+  context->rectangle(MARGIN_LEFT, 0, width - MARGIN_LEFT, height);
+  context->clip();
+  context->set_operator(Cairo::OPERATOR_SOURCE);
+  int64_t x_from = _columns.front().x;
+  if (_trace_valid && shift >= 0 && shift < plot_width) {
+    // scroll, and redraw from the previous newest column on; paths start 4 columns earlier, so that the pixels of the
+    // strip are drawn as a full redraw would
+    const double strip_x = width - MARGIN_RIGHT - shift - 2;
+    context->set_source(_trace, -shift, 0);
+    context->paint();
+    context->rectangle(strip_x, 0, width - strip_x, height);
+    context->clip();
+    x_from = _trace_x - 4;
+  }
+  context->set_operator(Cairo::OPERATOR_CLEAR);
+  context->paint();
+  context->set_operator(Cairo::OPERATOR_OVER);
+  // same pixel grid as on_draw(), where _trace is painted at a one-pixel offset
+  context->translate((width / 2) + 0.5f, (height / 2) + 0.5f);
+  draw_trace(context, x_from);
+
+  std::swap(_trace, _trace_back);
+  _trace_x = x_newest, _trace_valid = TRUE;
+}
+
+Gdk::Rectangle CairoTSPlot::get_damage_rect() {
+  const int width = get_allocation().get_width(), height = get_allocation().get_height();
+  // corners of the area, relative to the center of the widget, through _transform_matrix
+  double x[2] = {-width / 2.0, width / 2.0}, y[2] = {MARGIN_TOP - 4 - height / 2.0, height / 2.0};
+  double x_min = HUGE_VAL, x_max = -HUGE_VAL, y_min = HUGE_VAL, y_max = -HUGE_VAL;
+  for (unsigned i = 0; i < 4; ++i) {
+    double _x = x[i & 1], _y = y[i >> 1];
+    _transform_matrix.transform_point(_x, _y);
+    x_min = std::min(x_min, _x), x_max = std::max(x_max, _x), y_min = std::min(y_min, _y), y_max = std::max(y_max, _y);
+  }
+  return Gdk::Rectangle(std::floor(x_min + width / 2.0) - 1, std::floor(y_min + height / 2.0) - 1,
+                        std::ceil(x_max - x_min) + 2, std::ceil(y_max - y_min) + 2);
+}
+
+bool CairoTSPlot::on_draw(const Cairo::RefPtr<Cairo::Context> &context) {
+  const int width = get_allocation().get_width(), height = get_allocation().get_height(),
+            y_0 = (height / 2) - MARGIN_BOTTOM, x_offset = (width / 2) - MARGIN_RIGHT,
+            plot_width = width - MARGIN_LEFT - MARGIN_RIGHT;
+  const uint64_t head = _history ? _history->get_head() : 0;
   Cairo::TextExtents TE;
 
   context->set_antialias(Cairo::ANTIALIAS_SUBPIXEL);
@@ -89,45 +239,52 @@ bool CairoTSPlot::on_draw(const Cairo::RefPtr<Cairo::Context> &context) {
                       -(height / 2) - 0.5f);
   context->paint();
   context->set_line_width(1);
+  if (head == 0)
+    return TRUE;
 
-  // horizontal axis scale
-  auto timepoint = std::chrono::steady_clock::now();
-  for (unsigned i = 0; i < NUM_POINTS; ++i) {
-    struct value_struct &_s = _circbuf_get(_data, data_tail - i);
-    if (_s.has_timepoint) {
-      std::chrono::duration<double> diff = timepoint - _s.timepoint;
-      std::string label = std::to_string(static_cast<int>(diff.count())) + "s";
-
-      context->set_source_rgba(0.89, 0.89, 0.89, 1);
-      context->move_to(x_offset - (x_step * i), y_0 - _data_height);
-      context->line_to(x_offset - (x_step * i), y_0 + 4);
-      context->stroke();
+  // the newest sample is drawn at x_offset, and older ones to its left at 1 / _column_period pixels per tick
+  if (!decimate(plot_width))
+    _trace_valid = FALSE;
+  const auto newest = _history->get_time(head - 1);
+  const double px_per_s = plot_width / _window;
 
-      Gdk::Cairo::set_source_rgba(context, _text_rgba);
-      context->get_text_extents(label, TE);
-      context->move_to(x_offset - (x_step * i) - (TE.width / 2), y_0 + 11);
-      context->show_text(label);
+  // horizontal axis scale, at multiples of the first of LABEL_STEPS that puts labels LABEL_SPACING pixels apart
+  auto timepoint = std::chrono::steady_clock::now();
+  unsigned step = LABEL_STEPS[sizeof(LABEL_STEPS) / sizeof(LABEL_STEPS[0]) - 1];
+  for (unsigned i : LABEL_STEPS)
+    if (i * px_per_s >= LABEL_SPACING) {
+      step = i;
+      break;
     }
-  }
-
-  // draw plot
-  Gdk::Cairo::set_source_rgba(context, (is_alert_region = _circbuf_get(_data, data_tail).is_alerted) ? RGBA_ALERT
-                                                                                                     : RGBA_DEFAULT);
-  context->set_line_width(2);
-  context->move_to(x_offset, y_0 - yoffset_of(_circbuf_get(_data, data_tail).value));
-  for (unsigned i = 1; i < NUM_POINTS; ++i) {
-    struct value_struct &val = _circbuf_get(_data, data_tail - i);
-    if (val.value == HUGE_VAL)
+  const auto step_d = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::seconds(step));
+  for (auto t = newest - (newest.time_since_epoch() % step_d);; t -= step_d) {
+    double age = std::chrono::duration<double>(newest - t).count(), x = x_offset - age * px_per_s;
+    if (age > _window)
       break;
+    std::string label = format_age(timepoint - t);
 
-    context->line_to(x_offset - (x_step * i), y_0 - yoffset_of(val.value));
-    if (is_alert_region != val.is_alerted) { // set a different color for alerted region
-      context->stroke();
-      Gdk::Cairo::set_source_rgba(context, (is_alert_region = val.is_alerted) ? RGBA_ALERT : RGBA_DEFAULT);
-      context->move_to(x_offset - (x_step * i), y_0 - yoffset_of(val.value));
-    }
+    context->set_source_rgba(0.89, 0.89, 0.89, 1);
+    context->move_to(x, y_0 - _data_height);
+    context->line_to(x, y_0 + 4);
+    context->stroke();
+
+    Gdk::Cairo::set_source_rgba(context, _text_rgba);
+    context->get_text_extents(label, TE);
+    context->move_to(x - (TE.width / 2), y_0 + 11);
+    context->show_text(label);
   }
-  context->stroke();
+  if (_columns.empty())
+    return TRUE;
+
+  // draw plot; the trace changes only if samples arrived since the last paint
+  if (!_trace_valid || head != _painted_head)
+    update_trace();
+  context->set_source(_trace, -(width / 2) - 0.5f, -(height / 2) - 0.5f);
+  context->paint();
+
+  if (_paint_latency && head != _painted_head)
+    _paint_latency->record(newest);
+  _painted_head = head;
   return TRUE;
 }
 
@@ -136,23 +293,35 @@ void CairoTSPlot::on_size_allocate(Gtk::Allocation &allocation) {
   _data_height = allocation.get_height() - MARGIN_TOP - MARGIN_BOTTOM;
   if (_background)
     draw_background();
+  _trace = _trace_back = Cairo::RefPtr<Cairo::Surface>();
 }
 
-void CairoTSPlot::sample(void *arg, std::chrono::time_point<std::chrono::steady_clock> timepoint) {
-  std::chrono::duration<double> _diff = timepoint - _lasttimepoint;
-  bool hastimepoint = (_diff.count() >= 5.0f);
-  struct value_struct &_s = _circbuf_get(_data, _data_head.fetch_add(1));
+bool CairoTSPlot::on_scroll_event(GdkEventScroll *event) {
+  if (!_history || (event->direction != GDK_SCROLL_UP && event->direction != GDK_SCROLL_DOWN))
+    return FALSE;
+  // zoom in down to MIN_WINDOW_S, and out up to the whole history
+  double span = std::chrono::duration<double>(_history->get_span()).count();
+  if (event->direction == GDK_SCROLL_UP)
+    _window = std::max(_window / ZOOM_FACTOR, static_cast<double>(MIN_WINDOW_S));
+  else if (_window < span)
+    _window = std::min(_window * ZOOM_FACTOR, std::max(span, static_cast<double>(MIN_WINDOW_S)));
+  queue_draw();
+  return TRUE;
+}
 
-  _s.value = _sample_fn(arg, _s.is_alerted);
-  if ((_s.has_timepoint = hastimepoint))
-    _lasttimepoint = _s.timepoint = timepoint;
-  _data_changed = TRUE;
+void CairoTSPlot::sample(void *arg, uint32_t changed) {
+  if (!_history)
+    return;
+  if (changed & _sample_mask) {
+    bool is_alerted = FALSE;
+    float value = _sample_fn(arg, is_alerted);
+    _history->set(_channel, value, is_alerted);
+  } else {
+    _history->repeat(_channel);
+  }
 }
 
 void CairoTSPlot::update() {
-  if (_data_changed) {
-    _data_changed = FALSE;
-    get_window()->invalidate_rect(Gdk::Rectangle(0, 0, get_allocation().get_width(), get_allocation().get_height()),
-                                  FALSE);
-  }
+  if (_history && _history->get_head() != _painted_head)
+    get_window()->invalidate_rect(get_damage_rect(), FALSE);
 }
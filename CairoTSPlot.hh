@@ -16,10 +16,13 @@
 #ifndef CAIROTSPLOT_HH
 #define CAIROTSPLOT_HH
 
-#include <atomic>
+#include "LatencyHistogram.hh"
+#include "TSHistory.hh"
+
 #include <cairomm/context.h>
 #include <chrono>
-#include <cmath>
+#include <cstdint>
+#include <deque>
 #include <functional>
 #include <gtkmm.h>
 #include <string>
@@ -38,52 +41,94 @@ protected:
   static const Gdk::RGBA RGBA_DEFAULT;
   static const Gdk::RGBA RGBA_ALERT;
 
-  /// The CairoTSPlot widget stores historical values in a circular buffer of this size
-  static constexpr unsigned NUM_POINTS = 512;
-  static_assert((NUM_POINTS & (NUM_POINTS - 1)) == 0, "NUM_POINTS should be a power-of-two");
+  /// Minimum distance, in pixels, between labels of the horizontal axis, and the steps, in seconds, between them
+  static constexpr unsigned LABEL_SPACING = 48;
+  static constexpr unsigned LABEL_STEPS[] = {1, 2, 5, 10, 15, 30, 60, 120, 300, 600, 900, 1800, 3600, 7200, 14400};
+  /// Time span shown when zoomed in all the way, in seconds, and zoom factor of each step of the mouse wheel
+  static constexpr unsigned MIN_WINDOW_S = 10;
+  static constexpr double ZOOM_FACTOR = 2;
 
   typedef std::function<double(void *, bool &)> sample_fn_t;
-  struct value_struct {
-    double value;
+
+  /// Samples decimated to one pixel column: its first, minimum, maximum and last values.  A column is split in several
+  /// where the alerted state changes, so that alerted regions keep their bounds.
+  struct column {
+    int64_t x; /* column number, i.e. sample time divided by _column_period */
+    float first, min, max, last;
+    bool min_first; /* whether the minimum was seen before the maximum */
     bool is_alerted;
-    bool has_timepoint;
-    std::chrono::time_point<std::chrono::steady_clock> timepoint;
-    value_struct() : value(HUGE_VAL), is_alerted(FALSE), has_timepoint(FALSE) {}
   };
 
   std::string _text;
   sample_fn_t _sample_fn;
-  std::unique_ptr<value_struct[]> _data;
-  std::atomic_uint _data_head;
-  std::atomic_bool _data_changed;
-  std::chrono::time_point<std::chrono::steady_clock> _lasttimepoint;
+  uint32_t _sample_mask;
+  /// Shared history, and the channel of this plot; see set_history()
+  TSHistory *_history;
+  unsigned _channel;
+  /// Time span shown, in seconds
+  double _window;
+  /// Number of samples in _history when last painted
+  uint64_t _painted_head;
+  /// Decimated samples, oldest first, spanning at most the width of the plot, taken from _column_level of the history;
+  /// those before _columns_head have been decimated.  _column_period is the time span of a column, in clock ticks.
+  std::deque<column> _columns;
+  unsigned _column_level;
+  uint64_t _columns_head;
+  std::chrono::steady_clock::rep _column_period;
   double _value_min, _value_max, _tick_step, _data_height;
   Gdk::RGBA _text_rgba;
   Cairo::Matrix _transform_matrix;
   Cairo::RefPtr<Cairo::Surface> _background;
+  /// The trace, drawn incrementally: as new columns arrive it is scrolled left, and only those columns (and the last
+  /// one drawn, which may have grown since) are drawn.  A surface cannot be scrolled onto itself, hence _trace_back.
+  Cairo::RefPtr<Cairo::Surface> _trace, _trace_back;
+  int64_t _trace_x; /* newest column in _trace */
+  bool _trace_valid;
+  LatencyHistogram *_paint_latency;
 
   void draw_background(void);
+  /** Decimate the samples pushed to the history since the last call into _columns
+   * @param width Width of the plot in pixels, i.e. number of columns
+   * @return false if the columns were rebuilt from scratch, e.g. after a resize
+   */
+  bool decimate(int width);
+  /** Draw the columns from @a x_from on, newest first, into @a context; it should be translated as in on_draw()
+   */
+  void draw_trace(const Cairo::RefPtr<Cairo::Context> &context, int64_t x_from);
+  /// Bring _trace up to date with _columns
+  void update_trace();
+  /// Area that changes as samples arrive, i.e. all but the title
+  Gdk::Rectangle get_damage_rect();
 
   bool on_draw(const Cairo::RefPtr<Cairo::Context> &context) override;
   void on_size_allocate(Gtk::Allocation &allocation);
+  /// Zoom in or out with the mouse wheel
+  bool on_scroll_event(GdkEventScroll *event) override;
 
 public:
+  /// Default time span shown, in seconds
+  static constexpr double DEFAULT_WINDOW_S = 30;
+
   /** Construct a CairoTSPlot object
    * @param text Text rendered above the plot
    * @param fn std::function<double(void *, bool&)> that returns the
-   *     next value; the second argument is used to change the _alert
-   *     member of the current 'struct value_struct'
+   *     next value; the second argument tells whether the value is
+   *     drawn in the alert color
    * @param _m Minimum value of any sample
    * @param _M Maximum value of any sample
    * @param step Draw vertical axis scale using @a step increments
+   * @param mask Bitmask of the inputs that @a fn depends on; see sample()
    */
-  CairoTSPlot(std::string text, sample_fn_t fn, double _m, double _M, double step = 0)
-      : _text(text), _sample_fn(fn), _data(new value_struct[NUM_POINTS]), _data_head(0), _data_changed(FALSE),
-        _value_min(_m), _value_max(_M), _tick_step(step), _transform_matrix(Cairo::identity_matrix()) {
+  CairoTSPlot(std::string text, sample_fn_t fn, double _m, double _M, double step = 0, uint32_t mask = ~0u)
+      : _text(text), _sample_fn(fn), _sample_mask(mask), _history(nullptr), _channel(0), _window(DEFAULT_WINDOW_S),
+        _painted_head(0), _column_level(0), _columns_head(0), _column_period(0), _value_min(_m), _value_max(_M),
+        _tick_step(step), _transform_matrix(Cairo::identity_matrix()), _trace_x(0), _trace_valid(FALSE),
+        _paint_latency(nullptr) {
     get_style_context()->lookup_color("theme_text_color", _text_rgba);
+    add_events(Gdk::SCROLL_MASK);
   }
   CairoTSPlot(const CairoTSPlot &_o)
-      : CairoTSPlot(_o._text, _o._sample_fn, _o._value_min, _o._value_max, _o._tick_step) {}
+      : CairoTSPlot(_o._text, _o._sample_fn, _o._value_min, _o._value_max, _o._tick_step, _o._sample_mask) {}
   virtual ~CairoTSPlot() {}
 
   void set_transform_matrix(Cairo::Matrix &_m) {
@@ -91,12 +136,28 @@ public:
     queue_draw();
   }
 
-#define _circbuf_get(_b, _i) (_b[(_i) & (NUM_POINTS - 1)])
-  /** Call the @a fn function (constructor argument) and rotate _data;
-   * _data[_data_head] will be the new value.
+  /** Record the time from the timestamp of the newest sample (see sample()) to its first paint
+   */
+  void set_paint_latency(LatencyHistogram *h) { _paint_latency = h; }
+
+  /** Store the samples of this plot in a channel of @a history, which may be shared with other plots; should be called
+   * before the first call to sample()
+   * @param window Time span initially shown, in seconds; it may be changed with the mouse wheel.  Samples, or their
+   *     rollups, are decimated to the width of the plot, so that the cost of a paint does not depend on it.
+   */
+  void set_history(TSHistory &history, double window = DEFAULT_WINDOW_S) {
+    _history = &history, _channel = history.add_channel(), _window = window;
+    _painted_head = 0, _columns.clear(), _columns_head = 0, _column_period = 0, _trace_valid = FALSE;
+    queue_draw();
+  }
+
+  /** Call the @a fn function (constructor argument) and store its value in the sample of the shared history that is
+   * being written; TSHistory::push() should be called once all the plots that share it have been sampled.
+   * @param changed Bitmask of the inputs that changed since the last call; if none of those in the @a mask constructor
+   *     argument did, @a fn is not called and the previous value is repeated
    */
-  void sample(void *arg,
-              std::chrono::time_point<std::chrono::steady_clock> timepoint = std::chrono::steady_clock::now());
+  void sample(void *arg, uint32_t changed = ~0u);
+  /// Queue a redraw if samples were pushed to the history since the last paint
   void update();
 
 protected:
@@ -0,0 +1,99 @@
+/* LatencyHistogram.hh - lock-free log-linear latency histogram
+ *
+ * Copyright (C) Javier Lopez-Gomez, 2016
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef LATENCYHISTOGRAM_HH
+#define LATENCYHISTOGRAM_HH
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/// HDR-style histogram of latencies in microseconds.  Each power-of-two range is split in 2^SUB_BUCKET_BITS linear
+/// sub-buckets, so that percentiles are reported with a relative error below 1/2^SUB_BUCKET_BITS for any magnitude.
+/// record() may be called from any thread concurrently with the readers; counters are relaxed atomics.
+class LatencyHistogram {
+public:
+  static constexpr unsigned SUB_BUCKET_BITS = 4;
+  static constexpr unsigned SUB_BUCKET_COUNT = 1U << SUB_BUCKET_BITS;
+  static constexpr unsigned BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+
+private:
+  std::atomic<uint32_t> _counts[BUCKET_COUNT];
+  std::atomic<uint64_t> _total;
+
+  static unsigned index_of(uint64_t us) {
+    if (us < SUB_BUCKET_COUNT)
+      return us;
+    unsigned shift = (63 - __builtin_clzll(us)) - SUB_BUCKET_BITS;
+    return ((shift + 1) << SUB_BUCKET_BITS) + ((us >> shift) & (SUB_BUCKET_COUNT - 1));
+  }
+
+  /// Midpoint of the range of values counted in bucket @a index
+  static uint64_t value_of(unsigned index) {
+    if (index < SUB_BUCKET_COUNT)
+      return index;
+    unsigned shift = (index >> SUB_BUCKET_BITS) - 1;
+    uint64_t lo = static_cast<uint64_t>(SUB_BUCKET_COUNT + (index & (SUB_BUCKET_COUNT - 1))) << shift;
+    return lo + ((1ULL << shift) >> 1);
+  }
+
+public:
+  LatencyHistogram() { reset(); }
+  LatencyHistogram(const LatencyHistogram &) = delete;
+  LatencyHistogram &operator=(const LatencyHistogram &) = delete;
+
+  void record_us(uint64_t us) {
+    _counts[index_of(us)].fetch_add(1, std::memory_order_relaxed);
+    _total.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /// Record the time elapsed between @a since and @a now
+  void record(std::chrono::steady_clock::time_point since,
+              std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now()) {
+    auto d = std::chrono::duration_cast<std::chrono::microseconds>(now - since).count();
+    record_us(d > 0 ? d : 0);
+  }
+
+  uint64_t get_count() const { return _total.load(std::memory_order_relaxed); }
+
+  /** Get a percentile of the recorded values
+   * @param q Quantile in the range [0, 1], e.g. 0.99
+   * @return The latency in microseconds, or 0 if nothing has been recorded
+   */
+  uint64_t get_percentile_us(double q) const {
+    // the target is computed from a snapshot of the counts, not from _total: a record_us() or reset() that runs
+    // concurrently may leave _total out of step with the counts
+    uint32_t counts[BUCKET_COUNT];
+    uint64_t total = 0, acc = 0;
+    for (unsigned i = 0; i < BUCKET_COUNT; ++i)
+      total += (counts[i] = _counts[i].load(std::memory_order_relaxed));
+    if (total == 0)
+      return 0;
+    uint64_t target = std::min(std::max<uint64_t>(static_cast<uint64_t>(q * total + 0.5), 1), total);
+    unsigned i = 0;
+    while ((acc += counts[i]) < target)
+      ++i;
+    return value_of(i);
+  }
+
+  void reset() {
+    for (auto &i : _counts)
+      i.store(0, std::memory_order_relaxed);
+    _total.store(0, std::memory_order_relaxed);
+  }
+};
+
+#endif /* LATENCYHISTOGRAM_HH */
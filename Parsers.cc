@@ -15,111 +15,102 @@
 
 #include "Parsers.hh"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
 /** Use the REGISTER_TYPE(xxx) macro to add new parser types here.
  */
 const ParserFactory::ctor_funcs_t ParserFactory::_ctor_funcs = {
     REGISTER_TYPE(Fenix3Parser),
     REGISTER_TYPE(Fenix1Parser),
     REGISTER_TYPE(Fenix52BParser),
+    REGISTER_TYPE(AutoDetectParser),
 };
 
-bool Fenix1Parser::parse_frame(const unsigned char c[], int length, XR25Frame &fra) {
-  fra.program_vrsn = c[2];
-  fra.calib_vrsn = c[3];
-  fra.in_flags = (XR25InFlags)(remap_bit(c[4], 0x02, IN_PARKED) | remap_bit(c[4], 0x04, IN_AC_REQUEST) |
-                               remap_bit(c[4], 0x08, IN_THROTTLE_0) | remap_bit(c[4], 0x10, IN_THROTTLE_1) |
-                               remap_bit(c[4], 0x20, IN_AC_COMPRES));
-  // fra.out_flags     not sent?;
-  fra.map = 4 * c[5];
-  fra.rpm = ({
-    int tmp = (c[11] << 8) | c[10];
-    tmp ? (0x00e4e1c0 / tmp) : 0;
-  });
-  fra.throttle = c[22] / 2.55;
-  fra.fault_flags_1 = (XR25FaultFlags1)c[19];
-  fra.eng_pinging = c[14];
-  fra.injection_us = 2 * ((c[13] << 8) | c[12]);
-  fra.advance = c[15];
-  fra.fault_flags_0 = (XR25FaultFlags0)c[27];
-  fra.fault_fugitive = c[26];
-  fra.fault_flags_2 = (XR25FaultFlags2)c[18];
-  fra.temp_water = (c[6] / 1.6) - 40;
-  fra.temp_air = (c[7] / 1.6) - 40;
-  fra.battvalue = (c[8] / 32.0) + 8;
-  // fra.lambdavalue      = 6 * c[?];
-  fra.idle_regulation = c[16] / 2.55;
-  fra.idle_period = c[21];
-  fra.eng_pinging_delay = c[28];
-  fra.atmos_pressure = 4 * (~c[29] & 0xff);
-  fra.spd_km_h = c[20];
+constexpr XR25FieldDesc Fenix1Layout::fields[];
+constexpr XR25FieldDesc Fenix3Layout::fields[];
+constexpr XR25FieldDesc Fenix52BLayout::fields[];
+
+AutoDetectParser::AutoDetectParser() : _frame_count(0), _locked(-1) {
+  for (auto &i : ParserFactory::get_registered_types())
+    if (i.first != "AutoDetectParser")
+      _candidates.push_back({i.first, i.second(), XR25Frame{}, 0, 0});
+  std::sort(_candidates.begin(), _candidates.end(),
+            [](const candidate &a, const candidate &b) { return a.type < b.type; });
+}
 
-  return (length > 29);
+int AutoDetectParser::score(bool valid, const XR25Frame &fra, const XR25Frame *last) {
+  if (!valid)
+    return -8;
+  int ret = 0;
+  auto check = [&ret](bool decoded, bool plausible) {
+    if (decoded)
+      ret += plausible ? 1 : -2;
+  };
+  // ranges; temperatures and throttle cannot be out of range for any raw value
+  check(fra.rpm, fra.rpm <= 8000);
+  check(fra.map, fra.map >= 150);
+  check(fra.atmos_pressure, fra.atmos_pressure >= 700);
+  check(fra.battvalue, fra.battvalue >= 10);
+  check(fra.injection_us, fra.injection_us <= 30000);
+  // slowly-varying values do not jump between consecutive frames
+  if (last) {
+    check(fra.temp_water, std::fabs(fra.temp_water - last->temp_water) <= 2);
+    check(fra.temp_air, std::fabs(fra.temp_air - last->temp_air) <= 2);
+    check(fra.battvalue, std::fabs(fra.battvalue - last->battvalue) <= 1);
+    check(fra.atmos_pressure, std::abs(fra.atmos_pressure - last->atmos_pressure) <= 8);
+  }
+  return ret;
 }
 
-bool Fenix3Parser::parse_frame(const unsigned char c[], int length, XR25Frame &fra) {
-  fra.program_vrsn = c[2];
-  fra.calib_vrsn = c[3];
-  fra.in_flags = (XR25InFlags)c[4];
-  fra.out_flags = (XR25OutFlags)c[5];
-  fra.map = 4 * c[6];
-  fra.rpm = ({
-    int tmp = (c[8] << 8) | c[7];
-    tmp ? (0x00e4e1c0 / tmp) : 0;
-  });
-  fra.throttle = c[9] / 2.55;
-  fra.fault_flags_1 = (XR25FaultFlags1)c[10];
-  fra.eng_pinging = c[11];
-  fra.injection_us = 2 * ((c[13] << 8) | c[12]);
-  fra.advance = c[14];
-  fra.fault_flags_0 = (XR25FaultFlags0)c[16];
-  fra.fault_fugitive = c[17];
-  fra.fault_flags_2 = (XR25FaultFlags2)c[18];
-  fra.fault_flags_4 = (XR25FaultFlags4)c[19];
-  fra.fault_flags_3 = (XR25FaultFlags3)c[20];
-  fra.temp_water = (c[21] / 1.6) - 40;
-  fra.temp_air = (c[22] / 1.6) - 40;
-  fra.battvalue = (c[23] / 32.0) + 8;
-  fra.lambdavalue = 6 * c[24];
-  fra.idle_regulation = c[25] / 2.55;
-  fra.idle_period = c[26];
-  fra.eng_pinging_delay = c[27];
-  fra.atmos_pressure = 4 * (~c[28] & 0xff);
-  fra.afr_correction = c[30];
-  fra.spd_km_h = c[34];
+bool AutoDetectParser::parse_frame(const unsigned char c[], int length, XR25Frame &fra) {
+  int locked = _locked.load(std::memory_order_relaxed);
+  if (locked >= 0)
+    return _candidates[locked].parser->parse_frame(c, length, fra);
 
-  return (length > 34);
+  for (auto &k : _candidates) {
+    XR25Frame next{};
+    bool valid = k.parser->parse_frame(c, length, next);
+    k.score += score(valid, next, _frame_count ? &k.fra : nullptr);
+    k.fra = next, k.valid = valid;
+  }
+
+  size_t leader = 0;
+  int runner_up = std::numeric_limits<int>::min();
+  for (size_t i = 1; i < _candidates.size(); ++i)
+    if (_candidates[i].score > _candidates[leader].score)
+      runner_up = _candidates[leader].score, leader = i;
+    else
+      runner_up = std::max(runner_up, _candidates[i].score);
+  const candidate &best = _candidates[leader];
+  if (++_frame_count >= DETECT_MAX_FRAMES ||
+      (_frame_count >= DETECT_MIN_FRAMES && best.score >= runner_up + static_cast<int64_t>(DETECT_MARGIN)))
+    _locked = leader;
+
+  // the frame was speculatively parsed by every candidate; hand out the one of the leader
+#define X(_f) fra._f = best.fra._f;
+  XR25FRAME_FIELDS(X)
+#undef X
+  return best.valid;
 }
 
-bool Fenix52BParser::parse_frame(const unsigned char c[], int length, XR25Frame &fra) {
-  fra.program_vrsn = c[2];
-  fra.calib_vrsn = c[3];
-  fra.in_flags = (XR25InFlags)(remap_bit(c[6], 0x80, IN_THROTTLE_0) | remap_bit(c[6], 0x40, IN_THROTTLE_1));
-  fra.out_flags = (XR25OutFlags)(remap_bit(c[5], 0x80, OUT_LAMBDA_LOOP));
-  fra.map = 4 * c[24];
-  fra.rpm = ({
-    int tmp = (c[20] << 8) | c[19];
-    tmp ? (0x00e4e1c0 / tmp) : 0;
-  });
-  fra.throttle = c[25] / 2.55;
-  // fra.fault_flags_1 = c[?];
-  fra.eng_pinging = c[31];
-  // fra.injection_us  = 2 * ((c[?] << 8) | c[?]);
-  // fra.advance       = c[?];
-  // fra.fault_flags_0 = c[?];
-  // fra.fault_fugitive = c[?];
-  // fra.fault_flags_2 = c[?];
-  // fra.fault_flags_4 = c[?];
-  // fra.fault_flags_3 = c[?];
-  fra.temp_water = (c[27] / 1.6) - 40;
-  fra.temp_air = (c[28] / 1.6) - 40;
-  fra.battvalue = (c[29] / 32.0) + 8;
-  fra.lambdavalue = 6 * c[26];
-  // fra.idle_regulation = c[?] / 2.55;
-  // fra.idle_period     = c[?];
-  // fra.eng_pinging_delay = c[?];
-  // fra.atmos_pressure  = 4 * (~c[?] & 0xff);
-  // fra.afr_correction  = c[?];
-  fra.spd_km_h = c[30];
+std::string AutoDetectParser::get_leading_type() const {
+  int locked = _locked.load();
+  if (locked >= 0)
+    return _candidates[locked].type;
+  // ties are broken as in parse_frame(), in favor of the first candidate
+  auto leader = std::max_element(_candidates.begin(), _candidates.end(),
+                                 [](const candidate &a, const candidate &b) { return a.score < b.score; });
+  return leader->type;
+}
 
-  return (length == 52);
+void AutoDetectParser::parse_batch(const unsigned char *c, size_t stride, const int length[], size_t n,
+                                   XR25FrameColumns &cols, size_t first) {
+  int locked = _locked.load(std::memory_order_relaxed);
+  if (locked >= 0)
+    _candidates[locked].parser->parse_batch(c, stride, length, n, cols, first);
+  else
+    XR25FrameParser::parse_batch(c, stride, length, n, cols, first);
 }
@@ -16,32 +16,346 @@
 #ifndef PARSERS_HH
 #define PARSERS_HH
 
+#include "XR25columns.hh"
 #include "XR25streamreader.hh"
 
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <string>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
-/// Parse Siemens Fenix1 frames.  This parser is not tested; if you test it, please report feedback!
-class Fenix1Parser : public XR25FrameParser {
-public:
-  bool parse_frame(const unsigned char c[], int length, XR25Frame &fra) override;
+/* Frame layouts are declared as tables of XR25FieldDesc, one per field of XR25Frame that the ECU sends; fields that
+ * are not in the table are left untouched.  XR25TableParser generates the decoding of a table at compile time:
+ *   - single-octet fields are looked up in a 256-entry table, computed at compile time, of the target type; i.e.
+ *     scale factors, offsets and bit remapping cost one load;
+ *   - 16-bit fields are decoded with integer arithmetic.
+ * Batches of frames are decoded column by column (see XR25FrameParser::parse_batch()); 16-bit fields are then
+ * decoded several frames at a time with SIMD instructions.
+ */
+enum XR25FieldCoding : unsigned char {
+  CODING_LINEAR = 0, /* (raw ^ xor_mask) * mul / div + bias, converted to the type of the field */
+  CODING_RECIPROCAL, /* raw ? mul / raw : 0, using integer division; e.g. RPM from the period of a revolution */
+  CODING_BITS,       /* bitwise OR of bits[i] for each bit i that is set in raw; single-octet fields only */
 };
 
-/// Parse Siemens Fenix3 frames.
-class Fenix3Parser : public XR25FrameParser {
-public:
-  bool parse_frame(const unsigned char c[], int length, XR25Frame &fra) override;
+struct XR25FieldDesc {
+  XR25FieldIndex target;
+  unsigned char offset; /* offset of the first octet of the raw value, counting from the 0xff 0x00 header */
+  unsigned char width;  /* 1 or 2 octets */
+  bool big_endian;
+  XR25FieldCoding coding;
+  unsigned char xor_mask;
+  double mul, div, bias;
+  unsigned char bits[8];
 };
 
-/// Parse Siemens Fenix 52-byte frames sent, e.g. by the ECU mounted on the Renault R21 2.0TXI.
-/// This parser is incomplete; if you know the meaning of the remaining bytes, please contribute!
-class Fenix52BParser : public XR25FrameParser {
+/// A single-octet field, `(c[offset] ^ xor_mask) * mul / div + bias`; e.g. `c[27] / 1.6 - 40` is u8(f, 27, 1, 1.6, -40)
+constexpr XR25FieldDesc u8(XR25FieldIndex target, unsigned offset, double mul = 1, double div = 1, double bias = 0,
+                           unsigned char xor_mask = 0) {
+  return {target, static_cast<unsigned char>(offset), 1, 0, CODING_LINEAR, xor_mask, mul, div, bias, {}};
+}
+
+/// A 16-bit little-endian field, `raw * mul`; @a mul should be integral
+constexpr XR25FieldDesc u16le(XR25FieldIndex target, unsigned offset, double mul = 1) {
+  return {target, static_cast<unsigned char>(offset), 2, 0, CODING_LINEAR, 0, mul, 1, 0, {}};
+}
+
+/// A 16-bit little-endian field, `raw ? numerator / raw : 0`
+constexpr XR25FieldDesc u16le_reciprocal(XR25FieldIndex target, unsigned offset, uint32_t numerator) {
+  return {target, static_cast<unsigned char>(offset), 2, 0, CODING_RECIPROCAL, 0, double(numerator), 1, 0, {}};
+}
+
+/// A set of flags; @a b0 ... @a b7 are the flags set by each bit of the octet, from the LSB
+constexpr XR25FieldDesc bits(XR25FieldIndex target, unsigned offset, unsigned char b0, unsigned char b1,
+                             unsigned char b2, unsigned char b3, unsigned char b4, unsigned char b5, unsigned char b6,
+                             unsigned char b7) {
+  return {target, static_cast<unsigned char>(offset), 1, 0, CODING_BITS, 0, 1, 1, 0, {b0, b1, b2, b3, b4, b5, b6, b7}};
+}
+
+/// Type of XR25Frame field @a _F, and a reference to it or to its XR25FrameColumns column
+template <XR25FieldIndex _F>
+struct XR25FieldTraits;
+#define X(_f)                                                                                                          \
+  template <>                                                                                                          \
+  struct XR25FieldTraits<FIELD_INDEX_##_f> {                                                                           \
+    typedef decltype(XR25Frame::_f) type;                                                                              \
+    static type &ref(XR25Frame &fra) { return fra._f; }                                                                \
+    static type *column(XR25FrameColumns &cols) { return cols._f.data(); }                                            \
+  };
+XR25FRAME_FIELDS(X)
+#undef X
+
+/// Decodes frames whose layout is `_Layout::fields`, an array of XR25FieldDesc; `_Layout::MIN_LENGTH` and
+/// `_Layout::MAX_LENGTH` are the frame lengths that are accepted as valid.  The decoding of each field is generated
+/// and inlined at compile time; decode() may be called directly, without going through the virtual parse_frame().
+template <typename _Layout>
+class XR25TableParser : public XR25FrameParser {
+  template <typename _T>
+  struct lut_type {
+    typedef typename std::conditional<std::is_enum<_T>::value, std::underlying_type<_T>,
+                                      std::remove_cv<_T>>::type::type type;
+  };
+  template <typename _T>
+  struct lut {
+    _T v[256];
+  };
+
+  template <typename _T>
+  static constexpr _T octet_value(const XR25FieldDesc &d, unsigned x) {
+    if (d.coding == CODING_BITS) {
+      unsigned v = 0;
+      for (unsigned i = 0; i < 8; ++i)
+        v |= ((x >> i) & 1) ? d.bits[i] : 0;
+      return static_cast<_T>(v);
+    }
+    return static_cast<_T>((x ^ d.xor_mask) * d.mul / d.div + d.bias);
+  }
+
+  template <typename _T>
+  static constexpr lut<_T> make_lut(const XR25FieldDesc &d) {
+    lut<_T> t{};
+    for (unsigned x = 0; x < 256; ++x)
+      t.v[x] = octet_value<_T>(d, x);
+    return t;
+  }
+
+  /// Lookup table of field @a _I, if it is a single-octet field
+  template <size_t _I>
+  struct field_lut {
+    typedef typename lut_type<typename XR25FieldTraits<_Layout::fields[_I].target>::type>::type type;
+    typedef lut<type> table_type;
+    static constexpr table_type table = make_lut<type>(_Layout::fields[_I]);
+  };
+  template <size_t _I>
+  using is_octet = std::integral_constant<bool, _Layout::fields[_I].width == 1>;
+
+  /// Decode single-octet field @a _I
+  template <size_t _I>
+  static inline void decode_field(const unsigned char c[], XR25Frame &fra, std::true_type) {
+    constexpr XR25FieldDesc d = _Layout::fields[_I];
+    typedef XR25FieldTraits<d.target> traits;
+    traits::ref(fra) = static_cast<typename traits::type>(field_lut<_I>::table.v[c[d.offset]]);
+  }
+
+  template <bool _BigEndian>
+  static inline uint32_t raw16(const unsigned char *p) {
+    return _BigEndian ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+  }
+
+  /// Decode 16-bit field @a _I
+  template <size_t _I>
+  static inline void decode_field(const unsigned char c[], XR25Frame &fra, std::false_type) {
+    constexpr XR25FieldDesc d = _Layout::fields[_I];
+    typedef XR25FieldTraits<d.target> traits;
+    static_assert(d.width == 2, "width should be 1 or 2");
+    static_assert(d.coding != CODING_BITS && d.xor_mask == 0 && d.div == 1 && d.bias == 0 && d.mul >= 0 &&
+                      d.mul < (1u << 31) && d.mul == static_cast<uint32_t>(d.mul),
+                  "16-bit fields are decoded with integer arithmetic");
+    const uint32_t raw = raw16<d.big_endian>(c + d.offset);
+    const uint32_t mul = static_cast<uint32_t>(d.mul);
+    if (d.coding == CODING_RECIPROCAL)
+      traits::ref(fra) = static_cast<typename traits::type>(raw ? mul / raw : 0);
+    else
+      traits::ref(fra) = static_cast<typename traits::type>(raw * mul);
+  }
+
+  template <size_t... _I>
+  static inline void decode_fields(const unsigned char c[], XR25Frame &fra, std::index_sequence<_I...>) {
+    int expand[] = {0, (decode_field<_I>(c, fra, is_octet<_I>()), 0)...};
+    (void)expand;
+  }
+
+  /// Decode single-octet field @a _I of a batch of frames
+  template <size_t _I>
+  static void decode_column(const unsigned char *c, size_t stride, size_t n, XR25FrameColumns &cols, size_t first,
+                            std::true_type) {
+    constexpr XR25FieldDesc d = _Layout::fields[_I];
+    typedef XR25FieldTraits<d.target> traits;
+    typename traits::type *out = traits::column(cols) + first;
+    const auto *table = field_lut<_I>::table.v;
+    size_t i = 0;
+    c += d.offset;
+    // unrolled, so that loop overhead does not dominate the lookups
+    for (; i + 4 <= n; i += 4, c += 4 * stride) {
+      out[i] = static_cast<typename traits::type>(table[c[0]]);
+      out[i + 1] = static_cast<typename traits::type>(table[c[stride]]);
+      out[i + 2] = static_cast<typename traits::type>(table[c[2 * stride]]);
+      out[i + 3] = static_cast<typename traits::type>(table[c[3 * stride]]);
+    }
+    for (; i < n; ++i, c += stride)
+      out[i] = static_cast<typename traits::type>(table[*c]);
+  }
+
+  /// Decode 16-bit field @a _I of a batch of frames, four at a time.  Reciprocals are computed as a division in double
+  /// precision: for 16-bit denominators, the error is too small to change the integer part of the quotient.
+  template <size_t _I>
+  static void decode_column(const unsigned char *c, size_t stride, size_t n, XR25FrameColumns &cols, size_t first,
+                            std::false_type) {
+    typedef int32_t v4si __attribute__((vector_size(16)));
+    typedef double v4df __attribute__((vector_size(32)));
+    constexpr XR25FieldDesc d = _Layout::fields[_I];
+    typedef XR25FieldTraits<d.target> traits;
+    typename traits::type *out = traits::column(cols) + first;
+    const int32_t mul = static_cast<int32_t>(d.mul);
+
+    size_t i = 0;
+    c += d.offset;
+    for (; i + 4 <= n; i += 4, c += 4 * stride) {
+      v4si raw = {static_cast<int32_t>(raw16<d.big_endian>(c)), static_cast<int32_t>(raw16<d.big_endian>(c + stride)),
+                  static_cast<int32_t>(raw16<d.big_endian>(c + 2 * stride)),
+                  static_cast<int32_t>(raw16<d.big_endian>(c + 3 * stride))};
+      v4si v;
+      if (d.coding == CODING_RECIPROCAL) {
+        v4si zero = (raw == 0); /* -1 in the lanes where raw is 0 */
+        v4df den = __builtin_convertvector(raw, v4df) - __builtin_convertvector(zero, v4df);
+        v = __builtin_convertvector(d.mul / den, v4si) & ~zero;
+      } else {
+        v = raw * mul;
+      }
+      for (unsigned k = 0; k < 4; ++k)
+        out[i + k] = static_cast<typename traits::type>(v[k]);
+    }
+    for (c -= d.offset; i < n; ++i, c += stride) {
+      XR25Frame fra;
+      decode_field<_I>(c, fra, std::false_type());
+      out[i] = traits::ref(fra);
+    }
+  }
+
+  template <size_t... _I>
+  static inline void decode_columns(const unsigned char *c, size_t stride, size_t n, XR25FrameColumns &cols,
+                                    size_t first, std::index_sequence<_I...>) {
+    int expand[] = {0, (decode_column<_I>(c, stride, n, cols, first, is_octet<_I>()), 0)...};
+    (void)expand;
+  }
+
 public:
-  bool parse_frame(const unsigned char c[], int length, XR25Frame &fra) override;
+  static inline bool decode(const unsigned char c[], int length, XR25Frame &fra) {
+    decode_fields(c, fra, std::make_index_sequence<sizeof(_Layout::fields) / sizeof(XR25FieldDesc)>());
+    return length >= _Layout::MIN_LENGTH && length <= _Layout::MAX_LENGTH;
+  }
+
+  /// Decode a batch of frames; see XR25FrameParser::parse_batch()
+  static void decode_batch(const unsigned char *c, size_t stride, const int length[], size_t n,
+                           XR25FrameColumns &cols, size_t first = 0) {
+    unsigned char *valid = cols.valid.data() + first;
+    for (size_t i = 0; i < n; ++i)
+      valid[i] = length[i] >= _Layout::MIN_LENGTH && length[i] <= _Layout::MAX_LENGTH;
+    decode_columns(c, stride, n, cols, first,
+                   std::make_index_sequence<sizeof(_Layout::fields) / sizeof(XR25FieldDesc)>());
+  }
+
+  bool parse_frame(const unsigned char c[], int length, XR25Frame &fra) final { return decode(c, length, fra); }
+  void parse_batch(const unsigned char *c, size_t stride, const int length[], size_t n, XR25FrameColumns &cols,
+                   size_t first = 0) final {
+    decode_batch(c, stride, length, n, cols, first);
+  }
+};
+
+template <typename _Layout>
+template <size_t _I>
+constexpr typename XR25TableParser<_Layout>::template field_lut<_I>::table_type
+    XR25TableParser<_Layout>::field_lut<_I>::table;
+
+/// Frame layout of Siemens Fenix1 ECUs
+struct Fenix1Layout {
+  static constexpr int MIN_LENGTH = 30, MAX_LENGTH = XR25Deframer::MAX_FRAME_LENGTH;
+  static constexpr XR25FieldDesc fields[] = {
+      u8(FIELD_INDEX_program_vrsn, 2),
+      u8(FIELD_INDEX_calib_vrsn, 3),
+      bits(FIELD_INDEX_in_flags, 4, 0, IN_PARKED, IN_AC_REQUEST, IN_THROTTLE_0, IN_THROTTLE_1, IN_AC_COMPRES, 0, 0),
+      // out_flags: not sent?
+      u8(FIELD_INDEX_map, 5, 4),
+      u16le_reciprocal(FIELD_INDEX_rpm, 10, 0x00e4e1c0),
+      u8(FIELD_INDEX_throttle, 22, 1, 2.55),
+      u8(FIELD_INDEX_fault_flags_1, 19),
+      u8(FIELD_INDEX_eng_pinging, 14),
+      u16le(FIELD_INDEX_injection_us, 12, 2),
+      u8(FIELD_INDEX_advance, 15),
+      u8(FIELD_INDEX_fault_flags_0, 27),
+      u8(FIELD_INDEX_fault_fugitive, 26),
+      u8(FIELD_INDEX_fault_flags_2, 18),
+      u8(FIELD_INDEX_temp_water, 6, 1, 1.6, -40),
+      u8(FIELD_INDEX_temp_air, 7, 1, 1.6, -40),
+      u8(FIELD_INDEX_battvalue, 8, 1, 32, 8),
+      // lambdavalue: 6 * c[?]
+      u8(FIELD_INDEX_idle_regulation, 16, 1, 2.55),
+      u8(FIELD_INDEX_idle_period, 21),
+      u8(FIELD_INDEX_eng_pinging_delay, 28),
+      u8(FIELD_INDEX_atmos_pressure, 29, 4, 1, 0, 0xff),
+      u8(FIELD_INDEX_spd_km_h, 20),
+  };
+};
+
+/// Frame layout of Siemens Fenix3 ECUs
+struct Fenix3Layout {
+  static constexpr int MIN_LENGTH = 35, MAX_LENGTH = XR25Deframer::MAX_FRAME_LENGTH;
+  static constexpr XR25FieldDesc fields[] = {
+      u8(FIELD_INDEX_program_vrsn, 2),
+      u8(FIELD_INDEX_calib_vrsn, 3),
+      u8(FIELD_INDEX_in_flags, 4),
+      u8(FIELD_INDEX_out_flags, 5),
+      u8(FIELD_INDEX_map, 6, 4),
+      u16le_reciprocal(FIELD_INDEX_rpm, 7, 0x00e4e1c0),
+      u8(FIELD_INDEX_throttle, 9, 1, 2.55),
+      u8(FIELD_INDEX_fault_flags_1, 10),
+      u8(FIELD_INDEX_eng_pinging, 11),
+      u16le(FIELD_INDEX_injection_us, 12, 2),
+      u8(FIELD_INDEX_advance, 14),
+      u8(FIELD_INDEX_fault_flags_0, 16),
+      u8(FIELD_INDEX_fault_fugitive, 17),
+      u8(FIELD_INDEX_fault_flags_2, 18),
+      u8(FIELD_INDEX_fault_flags_4, 19),
+      u8(FIELD_INDEX_fault_flags_3, 20),
+      u8(FIELD_INDEX_temp_water, 21, 1, 1.6, -40),
+      u8(FIELD_INDEX_temp_air, 22, 1, 1.6, -40),
+      u8(FIELD_INDEX_battvalue, 23, 1, 32, 8),
+      u8(FIELD_INDEX_lambdavalue, 24, 6),
+      u8(FIELD_INDEX_idle_regulation, 25, 1, 2.55),
+      u8(FIELD_INDEX_idle_period, 26),
+      u8(FIELD_INDEX_eng_pinging_delay, 27),
+      u8(FIELD_INDEX_atmos_pressure, 28, 4, 1, 0, 0xff),
+      u8(FIELD_INDEX_afr_correction, 30),
+      u8(FIELD_INDEX_spd_km_h, 34),
+  };
 };
 
+/// Frame layout of Siemens Fenix 52-byte frames.  This layout is incomplete; if you know the meaning of the remaining
+/// bytes, please contribute!
+struct Fenix52BLayout {
+  static constexpr int MIN_LENGTH = 52, MAX_LENGTH = 52;
+  static constexpr XR25FieldDesc fields[] = {
+      u8(FIELD_INDEX_program_vrsn, 2),
+      u8(FIELD_INDEX_calib_vrsn, 3),
+      bits(FIELD_INDEX_in_flags, 6, 0, 0, 0, 0, 0, 0, IN_THROTTLE_1, IN_THROTTLE_0),
+      bits(FIELD_INDEX_out_flags, 5, 0, 0, 0, 0, 0, 0, 0, OUT_LAMBDA_LOOP),
+      u8(FIELD_INDEX_map, 24, 4),
+      u16le_reciprocal(FIELD_INDEX_rpm, 19, 0x00e4e1c0),
+      u8(FIELD_INDEX_throttle, 25, 1, 2.55),
+      u8(FIELD_INDEX_eng_pinging, 31),
+      u8(FIELD_INDEX_temp_water, 27, 1, 1.6, -40),
+      u8(FIELD_INDEX_temp_air, 28, 1, 1.6, -40),
+      u8(FIELD_INDEX_battvalue, 29, 1, 32, 8),
+      u8(FIELD_INDEX_lambdavalue, 26, 6),
+      u8(FIELD_INDEX_spd_km_h, 30),
+      // fault flags, injection_us, advance, idle_regulation, idle_period, eng_pinging_delay, atmos_pressure and
+      // afr_correction: unknown
+  };
+};
+
+/// Parse Siemens Fenix1 frames.  This parser is not tested; if you test it, please report feedback!
+class Fenix1Parser : public XR25TableParser<Fenix1Layout> {};
+
+/// Parse Siemens Fenix3 frames.
+class Fenix3Parser : public XR25TableParser<Fenix3Layout> {};
+
+/// Parse Siemens Fenix 52-byte frames sent, e.g. by the ECU mounted on the Renault R21 2.0TXI.
+class Fenix52BParser : public XR25TableParser<Fenix52BLayout> {};
+
 /// Helper class to construct a `FenixXyzParser` by name
 class ParserFactory {
 public:
@@ -56,6 +370,51 @@ public:
   static const ctor_funcs_t &get_registered_types() { return _ctor_funcs; }
 };
 
+/// Detects the frame layout of an unknown ECU: every other registered parser speculatively parses each frame and is
+/// scored on whether it accepts the frame length and on the physical plausibility of the values that it decodes (see
+/// score()).  The leader is locked onto once it is DETECT_MARGIN points ahead after at least DETECT_MIN_FRAMES frames,
+/// or after DETECT_MAX_FRAMES frames; until then, frames are decoded by the current leader.
+class AutoDetectParser : public XR25FrameParser {
+public:
+  static constexpr unsigned DETECT_MIN_FRAMES = 24, DETECT_MAX_FRAMES = 256;
+  static constexpr int DETECT_MARGIN = 48;
+
+private:
+  struct candidate {
+    std::string type;
+    ParserFactory::parser_ptr_t parser;
+    XR25Frame fra;
+    bool valid;
+    int score;
+  };
+  std::vector<candidate> _candidates; /* sorted by typename, so that ties are broken in the same way on every run */
+  unsigned _frame_count;
+  std::atomic_int _locked; /* index in _candidates of the parser locked onto, or -1 while detecting */
+
+  /** Score a parser on a frame; implausible values cost more than plausible ones earn, so that a wrong layout that
+   * happens to decode some fields correctly still loses.  Fields that a layout does not decode are 0, and not scored.
+   * @param valid Value returned by parse_frame()
+   * @param fra Decoded frame
+   * @param last Frame decoded from the previous frame by the same parser, or nullptr
+   */
+  static int score(bool valid, const XR25Frame &fra, const XR25Frame *last);
+
+public:
+  AutoDetectParser();
+
+  bool parse_frame(const unsigned char c[], int length, XR25Frame &fra) override;
+  void parse_batch(const unsigned char *c, size_t stride, const int length[], size_t n, XR25FrameColumns &cols,
+                   size_t first = 0) override;
+
+  /// Typename of the parser locked onto, or an empty string while detecting; may be called from any thread
+  std::string get_detected_type() const {
+    int i = _locked.load();
+    return (i < 0) ? std::string() : _candidates[i].type;
+  }
+  /// Typename of the parser locked onto or, while detecting, of the current leader; not thread-safe
+  std::string get_leading_type() const;
+};
+
 #define REGISTER_TYPE(_typename)                                                                                       \
   {                                                                                                                    \
     #_typename, []() { return std::make_shared<_typename>(); }                                                         \
@@ -0,0 +1,168 @@
+/* RangeCoder.hh - adaptive binary range coder
+ *
+ * Copyright (C) Javier Lopez-Gomez, 2016
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef RANGECODER_HH
+#define RANGECODER_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// Estimated probability of the next bit being 0, in units of 2^-BITS; it moves towards each coded bit by 2^-ADAPT_SHIFT
+/// of the distance, so that the model follows the statistics of the data.
+struct BitModel {
+  static constexpr unsigned BITS = 11, ADAPT_SHIFT = 5;
+  uint16_t p;
+
+  BitModel() : p(1u << (BITS - 1)) {}
+  void update(unsigned bit) {
+    if (bit)
+      p -= p >> ADAPT_SHIFT;
+    else
+      p += ((1u << BITS) - p) >> ADAPT_SHIFT;
+  }
+};
+
+/// Models for a `_BITS`-bit symbol that is coded MSB first; each bit is coded in the context of the bits before it.
+template <unsigned _BITS>
+struct BitTreeModel {
+  BitModel m[1u << _BITS];
+};
+
+/// Binary range encoder, after the one in LZMA, appending to a vector of octets.
+class RangeEncoder {
+  static constexpr uint32_t TOP = 1u << 24;
+
+  std::vector<unsigned char> &_out;
+  uint64_t _low;
+  uint32_t _range;
+  unsigned char _cache;
+  size_t _cache_size; /* pending octets: _cache followed by _cache_size - 1 0xff, which a carry may still change */
+
+  void shift_low() {
+    if (static_cast<uint32_t>(_low) < 0xff000000u || (_low >> 32) != 0) {
+      unsigned char carry = _low >> 32, c = _cache;
+      do {
+        _out.push_back(c + carry);
+        c = 0xff;
+      } while (--_cache_size);
+      _cache = (_low >> 24) & 0xff;
+    }
+    ++_cache_size;
+    _low = (_low & 0x00ffffffu) << 8;
+  }
+
+  void normalize() {
+    while (_range < TOP)
+      _range <<= 8, shift_low();
+  }
+
+public:
+  RangeEncoder(std::vector<unsigned char> &out) : _out(out) { reset(); }
+
+  /// Start a new stream, appended to the output vector
+  void reset() { _low = 0, _range = ~0u, _cache = 0, _cache_size = 1; }
+
+  void encode(BitModel &m, unsigned bit) {
+    uint32_t bound = (_range >> BitModel::BITS) * m.p;
+    if (bit)
+      _low += bound, _range -= bound;
+    else
+      _range = bound;
+    m.update(bit);
+    normalize();
+  }
+
+  template <unsigned _BITS>
+  void encode(BitTreeModel<_BITS> &t, unsigned symbol) {
+    for (unsigned i = _BITS, k = 1; i--;) {
+      unsigned bit = (symbol >> i) & 1;
+      encode(t.m[k], bit);
+      k = (k << 1) | bit;
+    }
+  }
+
+  /// Encode the @a nbits low-order bits of @a v, MSB first, with a fixed probability of 1/2
+  void encode_direct(uint64_t v, unsigned nbits) {
+    while (nbits--) {
+      _range >>= 1;
+      if ((v >> nbits) & 1)
+        _low += _range;
+      normalize();
+    }
+  }
+
+  /// Write out the remaining state; the encoder should not be used again until reset()
+  void flush() {
+    for (unsigned i = 0; i < 5; ++i)
+      shift_low();
+  }
+};
+
+/// Binary range decoder for the output of RangeEncoder.  Reading past the end of the input yields zeroes rather than
+/// failing, so that a corrupt stream decodes to garbage but never reads out of bounds.
+class RangeDecoder {
+  static constexpr uint32_t TOP = 1u << 24;
+
+  const unsigned char *_p, *_end;
+  uint32_t _range, _code;
+
+  unsigned char next() { return (_p < _end) ? *_p++ : 0; }
+  void normalize() {
+    if (_range < TOP)
+      _range <<= 8, _code = (_code << 8) | next();
+  }
+
+public:
+  RangeDecoder(const unsigned char *p, size_t length) : _p(p), _end(p + length), _range(~0u), _code(0) {
+    for (unsigned i = 0; i < 5; ++i)
+      _code = (_code << 8) | next();
+  }
+
+  unsigned decode(BitModel &m) {
+    uint32_t bound = (_range >> BitModel::BITS) * m.p;
+    unsigned bit = _code >= bound;
+    if (bit)
+      _code -= bound, _range -= bound;
+    else
+      _range = bound;
+    m.update(bit);
+    normalize();
+    return bit;
+  }
+
+  template <unsigned _BITS>
+  unsigned decode(BitTreeModel<_BITS> &t) {
+    unsigned k = 1;
+    for (unsigned i = 0; i < _BITS; ++i)
+      k = (k << 1) | decode(t.m[k]);
+    return k - (1u << _BITS);
+  }
+
+  uint64_t decode_direct(unsigned nbits) {
+    uint64_t v = 0;
+    while (nbits--) {
+      _range >>= 1;
+      unsigned bit = _code >= _range;
+      if (bit)
+        _code -= _range;
+      v = (v << 1) | bit;
+      normalize();
+    }
+    return v;
+  }
+};
+
+#endif /* RANGECODER_HH */
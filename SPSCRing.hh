@@ -0,0 +1,90 @@
+/* SPSCRing.hh - bounded single-producer / single-consumer lock-free ring
+ *
+ * Copyright (C) Javier Lopez-Gomez, 2016
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef SPSCRING_HH
+#define SPSCRING_HH
+
+#include <atomic>
+#include <cstddef>
+
+/// A bounded ring of `_T` records that may be written by exactly one thread and read by exactly one (other) thread
+/// without locking.  Each record is tagged with a sequence number; if the ring is full, push() drops the record and
+/// increments the overrun count, so that readers may tell lost records from the gaps in the sequence.
+template <typename _T, size_t _N>
+class SPSCRing {
+  static_assert((_N & (_N - 1)) == 0, "_N should be a power-of-two");
+
+public:
+  struct record {
+    unsigned long seq;
+    _T value;
+  };
+
+private:
+  record _buf[_N];
+  alignas(64) std::atomic<size_t> _head; /* written by the producer */
+  unsigned long _next_seq;
+  alignas(64) std::atomic<size_t> _tail; /* written by the consumer */
+  std::atomic_ulong _overrun_count;
+
+public:
+  SPSCRing() : _head(0), _next_seq(0), _tail(0), _overrun_count(0) {}
+  SPSCRing(const SPSCRing &) = delete;
+  SPSCRing &operator=(const SPSCRing &) = delete;
+
+  unsigned long get_overrun_count() const { return _overrun_count.load(std::memory_order_relaxed); }
+
+  /** Append a record; producer side
+   * @return false if the ring was full, i.e. the record was dropped
+   */
+  bool push(const _T &value) {
+    size_t h = _head.load(std::memory_order_relaxed);
+    unsigned long seq = _next_seq++;
+    if (h - _tail.load(std::memory_order_acquire) == _N) {
+      _overrun_count.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    _buf[h & (_N - 1)] = {seq, value};
+    _head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  /** Remove the oldest record; consumer side
+   * @return false if the ring was empty
+   */
+  bool pop(record &r) {
+    size_t t = _tail.load(std::memory_order_relaxed);
+    if (t == _head.load(std::memory_order_acquire))
+      return false;
+    r = _buf[t & (_N - 1)];
+    _tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  /** Call @a fn for every record in the ring, oldest first, and then release them all at once; consumer side
+   * @param fn Callable as `fn(const record &)`
+   * @return Number of records consumed
+   */
+  template <typename _F>
+  size_t drain(_F &&fn) {
+    size_t t = _tail.load(std::memory_order_relaxed), h = _head.load(std::memory_order_acquire);
+    for (size_t i = t; i != h; ++i)
+      fn(static_cast<const record &>(_buf[i & (_N - 1)]));
+    _tail.store(h, std::memory_order_release);
+    return h - t;
+  }
+};
+
+#endif /* SPSCRING_HH */
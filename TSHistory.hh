@@ -0,0 +1,299 @@
+/* TSHistory.hh - shared history of several time series
+ *
+ * Copyright (C) Javier Lopez-Gomez, 2016
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef TSHISTORY_HH
+#define TSHISTORY_HH
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/// History of several time series (channels) that are sampled at the same instants, e.g. the plots of a stream of
+/// frames.  Level 0 holds the last get_capacity() samples; levels 1 to LEVELS hold rollups (minimum, maximum and mean)
+/// of the samples in each period of level_period() seconds, i.e. 1 s, 10 s and 1 min, of which the last LEVEL_CAPACITY
+/// are kept.  Rollups are updated as samples are pushed, so that any time span, up to hours, may be read with bounded
+/// work from the level that suits it, in constant memory.
+/// Storage is column-wise: a timestamp ring per level and, per channel, float rings and an alert bitset; at level 0,
+/// that is 8 octets per sample plus 4 octets and 1 bit per sample and channel.  Samples and rollups (entries) are
+/// numbered from 0.
+/// Written by one thread (the producer), which fills in the channels of a sample through set() or repeat() and then
+/// appends it with push(), and read by any other thread (consumers); neither ever waits for the other.  Samples are
+/// published in batches of up to PUBLISH_BATCH, or of those pushed within PUBLISH_INTERVAL_MS: consumers see entries
+/// up to get_head(), which is advanced once per batch.  push() publishes only when called, so the producer should call
+/// publish() when it runs out of input, e.g. at the end of each block read.  Published entries do not change, except
+/// that
+///  - the producer overwrites the oldest ones as it goes: it reserves the slots of the next PUBLISH_BATCH samples at a
+///    time, so that entries before get_first() may be overwritten at any moment; and
+///  - the last rollup of each level is still open: it is updated as the batch is published, under a sequence count.
+/// read() copies an entry and then checks both, so that it never returns a torn one.
+class TSHistory {
+public:
+  typedef std::chrono::steady_clock clock;
+
+  /// Default number of samples held
+  static constexpr size_t DEFAULT_CAPACITY = 512;
+  /// Number of rollup levels, and number of rollups held by each
+  static constexpr unsigned LEVELS = 3;
+  static constexpr size_t LEVEL_CAPACITY = 4096;
+  /// push() publishes when PUBLISH_BATCH samples are pending, or if PUBLISH_INTERVAL_MS have passed since the last
+  /// publication
+  static constexpr unsigned PUBLISH_BATCH = 64, PUBLISH_INTERVAL_MS = 4;
+
+  /// A sample, or a rollup; for samples, min, max and mean are the value
+  struct entry {
+    clock::time_point time; /* time of the sample, or start of the period of the rollup */
+    float min, max, mean;
+    bool is_alerted; /* for rollups, whether any of the samples was alerted */
+  };
+
+  /// Period of the rollups of @a level, in seconds; 0 for level 0
+  static unsigned level_period(unsigned level) {
+    static const unsigned period[LEVELS + 1] = {0, 1, 10, 60};
+    return period[level];
+  }
+
+private:
+  typedef std::unique_ptr<std::atomic<float>[]> float_column;
+  struct channel {
+    float_column value;                                              /* level 0 */
+    float_column min[LEVELS + 1], max[LEVELS + 1], mean[LEVELS + 1]; /* levels 1 to LEVELS */
+    std::unique_ptr<std::atomic<uint64_t>[]> alert[LEVELS + 1];
+    entry open[LEVELS + 1]; /* producer side: the rollup being accumulated */
+  };
+  struct level {
+    size_t capacity;
+    std::unique_ptr<std::atomic<clock::rep>[]> time;
+    /* consumer-visible: entries published, entries whose slot may have been written, and a sequence count that is odd
+     * while the producer updates the last published entry */
+    std::atomic<uint64_t> head, reserved, seq;
+    /* producer side: entries written, period of the rollups in clock ticks, and start and samples of the open rollup */
+    uint64_t next;
+    clock::rep period, start;
+    unsigned count;
+  };
+
+  level _levels[LEVELS + 1];
+  std::vector<channel> _channels;
+  clock::time_point _published; /* time of the last publication */
+
+  size_t slot(unsigned l, uint64_t n) const { return n & (_levels[l].capacity - 1); }
+  static void set_bit(std::atomic<uint64_t> b[], size_t i, bool v) {
+    uint64_t m = 1ULL << (i & 63), w = b[i >> 6].load(std::memory_order_relaxed);
+    b[i >> 6].store(v ? (w | m) : (w & ~m), std::memory_order_relaxed);
+  }
+  static bool get_bit(const std::atomic<uint64_t> b[], size_t i) {
+    return (b[i >> 6].load(std::memory_order_relaxed) >> (i & 63)) & 1;
+  }
+  static float_column make_column(size_t n) {
+    float_column ret(new std::atomic<float>[n]);
+    for (size_t i = 0; i < n; ++i)
+      ret[i].store(std::numeric_limits<float>::quiet_NaN(), std::memory_order_relaxed);
+    return ret;
+  }
+
+  /// Announce that the slots of entries up to @a n (exclusive) of level @a l are about to be overwritten
+  void reserve(unsigned l, uint64_t n) {
+    _levels[l].reserved.store(n, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  /// Store the open rollup of level @a l, i.e. entry `next - 1`, in its slot
+  void store_rollup(unsigned l) {
+    level &lv = _levels[l];
+    const uint64_t n = lv.next - 1, seq = lv.seq.load(std::memory_order_relaxed);
+    const size_t r = slot(l, n);
+    if (n >= lv.reserved.load(std::memory_order_relaxed))
+      reserve(l, n + 1);
+    lv.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    lv.time[r].store(lv.start, std::memory_order_relaxed);
+    for (auto &c : _channels) {
+      c.min[l][r].store(c.open[l].min, std::memory_order_relaxed);
+      c.max[l][r].store(c.open[l].max, std::memory_order_relaxed);
+      c.mean[l][r].store(c.open[l].mean, std::memory_order_relaxed);
+      set_bit(c.alert[l].get(), r, c.open[l].is_alerted);
+    }
+    lv.seq.store(seq + 2, std::memory_order_release);
+  }
+
+  /// Add sample @a i of level 0, taken at @a ts, to the open rollup of level @a l, or close it and start a new one
+  void roll_up(unsigned l, size_t i, clock::rep ts) {
+    level &lv = _levels[l];
+    const bool start = (lv.next == 0) || (ts / lv.period * lv.period != lv.start);
+    if (start && lv.next)
+      store_rollup(l);
+    if (start)
+      lv.next++, lv.start = ts / lv.period * lv.period;
+    lv.count = start ? 1 : lv.count + 1;
+    for (auto &c : _channels) {
+      entry &e = c.open[l];
+      float v = c.value[i].load(std::memory_order_relaxed);
+      bool a = get_bit(c.alert[0].get(), i);
+      if (start) {
+        e.min = e.max = e.mean = v, e.is_alerted = a;
+        continue;
+      }
+      // fmin() and fmax() ignore NaN, i.e. channels that were not set yet
+      e.min = std::fmin(e.min, v), e.max = std::fmax(e.max, v);
+      e.mean = std::isnan(e.mean) ? v : e.mean + (v - e.mean) / lv.count;
+      e.is_alerted |= a;
+    }
+  }
+
+public:
+  /** Construct an empty history
+   * @param capacity Number of samples held at level 0; a power of two, at least 2 * PUBLISH_BATCH
+   */
+  explicit TSHistory(size_t capacity = DEFAULT_CAPACITY) {
+    for (unsigned l = 0; l <= LEVELS; ++l) {
+      level &lv = _levels[l];
+      lv.capacity = l ? LEVEL_CAPACITY : capacity;
+      lv.time.reset(new std::atomic<clock::rep>[lv.capacity]);
+      for (size_t i = 0; i < lv.capacity; ++i)
+        lv.time[i].store(0, std::memory_order_relaxed);
+      lv.head = 0, lv.reserved = l ? 0 : PUBLISH_BATCH, lv.seq = 0;
+      lv.next = 0;
+      lv.period = std::chrono::duration_cast<clock::duration>(std::chrono::seconds(level_period(l))).count();
+      lv.start = 0, lv.count = 0;
+    }
+  }
+  TSHistory(const TSHistory &) = delete;
+  TSHistory &operator=(const TSHistory &) = delete;
+
+  /// Add a channel; its samples read as NaN until set.  Not thread-safe: channels should be added before the first
+  /// push()
+  unsigned add_channel() {
+    channel c;
+    c.value = make_column(_levels[0].capacity);
+    c.alert[0].reset(new std::atomic<uint64_t>[_levels[0].capacity / 64]());
+    for (unsigned l = 1; l <= LEVELS; ++l) {
+      c.min[l] = make_column(LEVEL_CAPACITY), c.max[l] = make_column(LEVEL_CAPACITY);
+      c.mean[l] = make_column(LEVEL_CAPACITY);
+      c.alert[l].reset(new std::atomic<uint64_t>[LEVEL_CAPACITY / 64]());
+    }
+    _channels.push_back(std::move(c));
+    return _channels.size() - 1;
+  }
+
+  size_t get_capacity(unsigned level = 0) const { return _levels[level].capacity; }
+  /// Number of entries published so far
+  uint64_t get_head(unsigned level = 0) const { return _levels[level].head.load(std::memory_order_acquire); }
+  /// Oldest entry that is not being overwritten; entries from get_first() to get_head() may be read
+  uint64_t get_first(unsigned level = 0) const {
+    uint64_t r = _levels[level].reserved.load(std::memory_order_acquire);
+    return (r > _levels[level].capacity) ? r - _levels[level].capacity : 0;
+  }
+  /// Whether @a level holds at least the last @a span of samples, or all of them
+  bool holds(unsigned level, clock::duration span) const {
+    uint64_t h0 = get_head(0), first = get_first(level);
+    if (first == 0 || h0 == 0)
+      return true;
+    return get_time(h0 - 1) - get_time(first, level) >= span;
+  }
+
+  /// Time from the oldest sample held, at any level, to the newest one
+  clock::duration get_span() const {
+    uint64_t h0 = get_head(0);
+    if (h0 == 0 || get_head(LEVELS) == 0)
+      return clock::duration::zero();
+    return get_time(h0 - 1) - get_time(get_first(LEVELS), LEVELS);
+  }
+
+  /// Set the value of channel @a ch in the sample being written; producer side
+  void set(unsigned ch, float value, bool is_alerted) {
+    size_t i = slot(0, _levels[0].next);
+    _channels[ch].value[i].store(value, std::memory_order_relaxed);
+    set_bit(_channels[ch].alert[0].get(), i, is_alerted);
+  }
+
+  /// Copy the previous value of channel @a ch into the sample being written; producer side
+  void repeat(unsigned ch) {
+    uint64_t n = _levels[0].next;
+    size_t i = slot(0, n), p = slot(0, n - 1);
+    _channels[ch].value[i].store(_channels[ch].value[p].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    set_bit(_channels[ch].alert[0].get(), i, get_bit(_channels[ch].alert[0].get(), p));
+  }
+
+  /** Append the sample being written, which was taken at @a t, and add it to the rollups; producer side.  The sample is
+   * published along with the rest of its batch.
+   */
+  void push(clock::time_point t) {
+    level &lv = _levels[0];
+    size_t i = slot(0, lv.next);
+    clock::rep ts = t.time_since_epoch().count();
+    lv.time[i].store(ts, std::memory_order_relaxed);
+    for (unsigned l = 1; l <= LEVELS; ++l)
+      roll_up(l, i, ts);
+    if (++lv.next - lv.head.load(std::memory_order_relaxed) >= PUBLISH_BATCH ||
+        clock::now() - _published >= std::chrono::milliseconds(PUBLISH_INTERVAL_MS))
+      publish();
+    // the slots of the next batch are reserved before set() writes the first of them
+    if (lv.next == lv.reserved.load(std::memory_order_relaxed))
+      reserve(0, lv.next + PUBLISH_BATCH);
+  }
+
+  /// Publish the samples pushed so far, and the open rollups; producer side.  Called by push() as needed, and by the
+  /// producer whenever it runs out of input, so that no sample stays unpublished while it waits.
+  void publish() {
+    _published = clock::now();
+    for (unsigned l = 1; l <= LEVELS; ++l) {
+      level &lv = _levels[l];
+      if (lv.next) {
+        store_rollup(l);
+        lv.head.store(lv.next, std::memory_order_release);
+      }
+    }
+    _levels[0].head.store(_levels[0].next, std::memory_order_release);
+  }
+
+  /** Copy entry @a n of channel @a ch at @a level into @a e; consumer side.  Does not wait for the producer.
+   * @param n Entry number, less than get_head(level)
+   * @return false if the producer was updating it, or had overwritten it; in the former case, i.e. if @a n is still
+   *     not less than get_first(level), it may be read again later
+   */
+  bool read(unsigned ch, uint64_t n, unsigned level, entry &e) const {
+    const struct level &lv = _levels[level];
+    const channel &c = _channels[ch];
+    const size_t i = slot(level, n);
+    const uint64_t seq = lv.seq.load(std::memory_order_acquire);
+    if (seq & 1)
+      return false;
+    e.time = clock::time_point(clock::duration(lv.time[i].load(std::memory_order_relaxed)));
+    if (level) {
+      e.min = c.min[level][i].load(std::memory_order_relaxed), e.max = c.max[level][i].load(std::memory_order_relaxed);
+      e.mean = c.mean[level][i].load(std::memory_order_relaxed);
+    } else {
+      e.min = e.max = e.mean = c.value[i].load(std::memory_order_relaxed);
+    }
+    e.is_alerted = get_bit(c.alert[level].get(), i);
+    // pairs with the release fences of the producer: if any of the above saw a write, so do these loads
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return n >= get_first(level) && (level == 0 || lv.seq.load(std::memory_order_relaxed) == seq);
+  }
+
+  /// Time of entry @a n of @a level; it may be overwritten in the meantime, see read()
+  clock::time_point get_time(uint64_t n, unsigned level = 0) const {
+    return clock::time_point(clock::duration(_levels[level].time[slot(level, n)].load(std::memory_order_relaxed)));
+  }
+};
+
+#endif /* TSHISTORY_HH */
@@ -14,30 +14,59 @@
  */
 
 #include "UI.hh"
+#include "Parsers.hh"
 
-UI::UI(Glib::RefPtr<Gtk::Application> _a, Glib::RefPtr<Gtk::Builder> _b, std::istream &_is, const XR25FrameParser &_p)
-    : _application(_a), _builder(_b), _xr25reader(_is,
-                                                  [this](const unsigned char c[], int l, XR25Frame &fra) {
-                                                    this->_last_recv_mutex.lock();
-                                                    this->_last_recv = fra;
-                                                    this->_last_recv_mutex.unlock();
-
-                                                    // call CairoTSPlots::sample() passing fra
-                                                    auto _ts = std::chrono::steady_clock::now();
-                                                    for (auto &i : _plot)
-                                                      i.sample(&fra, _ts);
-                                                  }),
-      _fp(_p), _last_recv() {
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iterator>
+
+/// Format @a v into @a buf as std::to_string() does, without allocating
+static void format_value(char *buf, size_t n, int v) { std::snprintf(buf, n, "%d", v); }
+static void format_value(char *buf, size_t n, double v) { std::snprintf(buf, n, "%f", v); }
+
+UI::UI(Glib::RefPtr<Gtk::Application> _a, Glib::RefPtr<Gtk::Builder> _b, int _fd, std::ostream *_tee,
+       std::ostream *_tee_ts, XR25RecordingWriter *_tee_rec, const XR25FrameParser &_p, unsigned _plot_window,
+       XR25Replay *_r)
+    : _application(_a), _builder(_b), _xr25reader(
+                                          _fd,
+                                          [this](const unsigned char c[], int l, XR25Frame &fra) {
+                                            // frames that are identical to the previous one are not queued
+                                            if (fra.changed)
+                                              this->_frame_ring.push(fra);
+
+                                            // call CairoTSPlots::sample() passing fra; all of them share _history
+                                            for (auto &i : _plot)
+                                              i.sample(&fra, fra.changed);
+                                            _history.push(fra.timestamp);
+                                          },
+                                          _tee, _tee_ts, _tee_rec),
+      _fp(_p), _replay(_r), _history(PLOT_HISTORY_SAMPLES), _plot_window(_plot_window), _last_recv(),
+      _page_changed(FIELD_ALL), _page_last(-1), _page_overruns(0), _replay_seek(nullptr) {
   _builder->get_widget("mw_hb_sync_err", _hb_sync_err);
   _builder->get_widget("mw_hb_fra_s", _hb_fra_s);
+  _builder->get_widget("mw_hb_lat_p50", _hb_lat_p50);
+  _builder->get_widget("mw_hb_lat_p99", _hb_lat_p99);
   _builder->get_widget("mw_hb_is_sync", _hb_is_sync);
   _builder->get_widget("mw_hb", _hb);
   _builder->get_widget("mw_notebook", _notebook);
 
+  for (std::ostream *i : {_tee, _tee_ts})
+    if (auto buf = i ? dynamic_cast<async_filebuf *>(i->rdbuf()) : nullptr)
+      _capture_bufs.push_back(buf);
+  if (_tee_rec)
+    _capture_bufs.push_back(&_tee_rec->get_filebuf());
+
   for (int i = 0; i < E_COUNT; i++)
     _builder->get_widget("mw_e" + std::to_string(i), _entry[i]);
   for (int i = 0; i < F_COUNT; i++)
     _builder->get_widget("mw_f" + std::to_string(i), _flag[i]);
+  std::fill(std::begin(_entry_value), std::end(_entry_value), NAN);
+  std::fill(std::begin(_flag_value), std::end(_flag_value), -1);
+  for (auto &i : _plot)
+    i.set_history(_history, _plot_window);
+  // samples are otherwise published in batches; do not hold back the last ones while the reader waits for input
+  _xr25reader.set_post_block([this]() { _history.publish(); });
 }
 
 void UI::run() {
@@ -47,6 +76,10 @@ void UI::run() {
   _builder->get_widget("mw_plot_grid", plot_grid);
   attach_widgets_to_grid<CairoGauge>(dash_grid, _g_rect[GRID_DASHBOARD], _gauge);
   attach_widgets_to_grid<CairoTSPlot>(plot_grid, _g_rect[GRID_PLOTS], _plot);
+  for (auto &i : _gauge)
+    i.set_paint_latency(&_paint_latency);
+  for (auto &i : _plot)
+    i.set_paint_latency(&_paint_latency);
 
   /* connect signals */
   Glib::signal_timeout().connect(sigc::mem_fun(*this, &UI::update_page), 1000 / UI_UPDATE_PAGE_HZ);
@@ -72,12 +105,35 @@ void UI::run() {
   });
 
   _xr25reader.start(const_cast<XR25FrameParser &>(_fp));
+  if (_replay)
+    setup_replay_controls(), _replay->start();
 
   Gtk::Window *main_window = nullptr;
   _builder->get_widget("main_window", main_window);
   _application->run(*main_window);
 }
 
+void UI::setup_replay_controls() {
+  Gtk::Box *replay_box = nullptr;
+  Gtk::ToggleButton *pause = nullptr;
+  Gtk::ComboBoxText *speed = nullptr;
+  _builder->get_widget("mw_replay_box", replay_box);
+  _builder->get_widget("mw_replay_pause", pause);
+  _builder->get_widget("mw_replay_seek", _replay_seek);
+  _builder->get_widget("mw_replay_speed", speed);
+
+  _replay_seek->set_range(0, _replay->get_duration());
+  // only user interaction emits 'change-value'; update_header() moves the slider through set_value()
+  _replay_seek->signal_change_value().connect([this](Gtk::ScrollType, double value) {
+    _replay->seek(value);
+    return false;
+  });
+  pause->signal_toggled().connect([this, pause]() { _replay->set_paused(pause->get_active()); });
+  speed->signal_changed().connect([this, speed]() { _replay->set_speed(std::stod(speed->get_active_id())); });
+  _replay->set_speed(std::stod(speed->get_active_id()));
+  replay_box->show();
+}
+
 bool UI::update_page() {
   sigc::bound_mem_functor1<void, UI, XR25Frame &> _fn[] = {
       sigc::mem_fun(*this, &UI::update_page_diagnostic),
@@ -85,27 +141,89 @@ bool UI::update_page() {
       sigc::mem_fun(*this, &UI::update_page_dashboard),
   };
 
-  _last_recv_mutex.lock();
-  XR25Frame fra = _last_recv;
-  _last_recv_mutex.unlock();
+  // a field may have changed only in frames that were dropped because the ring was full; read before draining, so that
+  // frames dropped meanwhile are noticed on the next call
+  unsigned long overruns = _frame_ring.get_overrun_count();
+  if (overruns != _page_overruns)
+    _page_changed = FIELD_ALL, _page_overruns = overruns;
+  _frame_ring.drain([this](const decltype(_frame_ring)::record &r) {
+    _last_recv = r.value;
+    _page_changed |= r.value.changed;
+  });
 
-  _fn[_notebook->get_current_page()](fra);
+  // widgets of the other pages were not updated while hidden
+  int page = _notebook->get_current_page();
+  if (page != _page_last)
+    _page_changed = FIELD_ALL, _page_last = page;
+  _fn[page](_last_recv);
+  _page_changed = 0;
   return TRUE;
 }
 
 bool UI::update_header() {
-  _hb_sync_err->set_text(std::to_string(_xr25reader.get_sync_err_count()));
+  XR25DeframerErrors err = _xr25reader.get_errors();
+  _hb_sync_err->set_text(std::to_string(err.total()));
+  _hb_sync_err->set_tooltip_text(std::to_string(err.overflow) + " overflow, " + std::to_string(err.short_frame) +
+                                 " short frame, " + std::to_string(err.bad_escape) + " bad escape");
   _hb_fra_s->set_text(std::to_string(_xr25reader.get_frames_per_sec()));
   _hb_is_sync->set_from_icon_name(_xr25reader.is_synchronized() ? "gtk-yes" : "gtk-no", Gtk::ICON_SIZE_BUTTON);
-  _hb->set_subtitle("Frame count: " + std::to_string(_xr25reader.get_fra_count()));
+  std::string subtitle = "Frame count: " + std::to_string(_xr25reader.get_fra_count()) +
+                         ", overruns: " + std::to_string(_frame_ring.get_overrun_count());
+  if (auto p = dynamic_cast<const AutoDetectParser *>(&_fp)) {
+    std::string type = p->get_detected_type();
+    subtitle += ", parser: " + (type.empty() ? std::string("detecting...") : type);
+  }
+  if (!_capture_bufs.empty()) {
+    // disk stall: longest write() of a capture buffer during the last period
+    uint64_t written = 0, dropped = 0, stall_us = 0;
+    for (auto i : _capture_bufs) {
+      written += i->get_written_count(), dropped += i->get_dropped_count();
+      stall_us = std::max(stall_us, i->get_write_latency().get_percentile_us(1));
+      i->get_write_latency().reset();
+    }
+    char buf[128];
+    std::snprintf(buf, sizeof(buf), ", saved: %.1f kB (%llu B dropped), disk stall: %.1f ms", written / 1e3,
+                  static_cast<unsigned long long>(dropped), stall_us / 1e3);
+    subtitle += buf;
+  }
+  _hb->set_subtitle(subtitle);
+  if (_replay)
+    _replay_seek->set_value(_replay->get_position());
+
+  // parse / dispatch / paint latency, in milliseconds
+  LatencyHistogram *lat[] = {&_xr25reader.get_parse_latency(), &_xr25reader.get_dispatch_latency(), &_paint_latency};
+  auto set_latency_text = [&lat](Gtk::Label *label, double q) {
+    char buf[64];
+    std::snprintf(buf, sizeof(buf), "%.1f / %.1f / %.1f ms", lat[0]->get_percentile_us(q) / 1e3,
+                  lat[1]->get_percentile_us(q) / 1e3, lat[2]->get_percentile_us(q) / 1e3);
+    label->set_text(buf);
+  };
+  set_latency_text(_hb_lat_p50, 0.5);
+  set_latency_text(_hb_lat_p99, 0.99);
+  for (auto i : lat)
+    i->reset();
 
   return TRUE;
 }
 
 void UI::update_page_diagnostic(XR25Frame &fra) {
-  auto update_entry = [&](unsigned index, auto data) { _entry[index]->set_text(std::to_string(data)); };
+  // only the widgets whose value differs from the one shown are updated, whether or not the frames that changed it
+  // were seen; text is formatted on the stack and set through the C API, so that no std::string nor Glib::ustring is
+  // allocated
+  auto update_entry = [&](unsigned index, auto data) {
+    if (_entry_value[index] == data)
+      return;
+    char buf[32];
+    format_value(buf, sizeof(buf), data);
+    gtk_entry_set_text(_entry[index]->gobj(), buf);
+    _entry_value[index] = data;
+  };
   auto update_flag = [&](unsigned index, auto data) {
-    _flag[index]->set(data ? Gtk::ARROW_RIGHT : Gtk::ARROW_NONE, Gtk::SHADOW_OUT);
+    signed char value = data ? 1 : 0;
+    if (_flag_value[index] == value)
+      return;
+    _flag[index]->set(value ? Gtk::ARROW_RIGHT : Gtk::ARROW_NONE, Gtk::SHADOW_OUT);
+    _flag_value[index] = value;
   };
 
   update_entry(E_PROGRAM_VRSN, fra.program_vrsn);
@@ -165,7 +283,7 @@ void UI::update_page_diagnostic(XR25Frame &fra) {
 
 void UI::update_page_dashboard(XR25Frame &fra) {
   for (auto &i : _gauge)
-    i.update(&fra);
+    i.update(&fra, fra.timestamp, _page_changed);
 }
 
 void UI::update_page_plots(XR25Frame &fra) {
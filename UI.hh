@@ -18,10 +18,13 @@
 
 #include "CairoGauge.hh"
 #include "CairoTSPlot.hh"
+#include "SPSCRing.hh"
+#include "TSHistory.hh"
+#include "XR25replay.hh"
 #include "XR25streamreader.hh"
+#include "async_filebuf.hh"
 
 #include <gtkmm.h>
-#include <mutex>
 #include <pangomm/context.h>
 #include <vector>
 
@@ -31,13 +34,31 @@ private:
   Glib::RefPtr<Gtk::Builder> _builder;
   XR25StreamReader _xr25reader;
   const XR25FrameParser &_fp;
-
+  /// Replay engine that feeds _xr25reader, or nullptr if reading from a device
+  XR25Replay *_replay;
+
+  /// Frames received by the reader thread, pending to be consumed by the GTK main loop
+  SPSCRing<XR25Frame, 1024> _frame_ring;
+  /// Samples of the plots and their rollups, written by the reader thread
+  TSHistory _history;
+  double _plot_window;
+  /// Last frame drained from _frame_ring
   XR25Frame _last_recv;
-  std::mutex _last_recv_mutex;
-
-  Gtk::Label *_hb_sync_err, *_hb_fra_s;
+  /// Fields that changed since the notebook page was last updated, see update_page(); all of them after a page switch
+  uint32_t _page_changed;
+  int _page_last;
+  /// Overrun count of _frame_ring at the last update_page()
+  unsigned long _page_overruns;
+
+  /// Time from the arrival of a frame header to the paint of a value taken from that frame
+  LatencyHistogram _paint_latency;
+  /// Background writers of the received data, if it is being saved; see update_header()
+  std::vector<async_filebuf *> _capture_bufs;
+
+  Gtk::Label *_hb_sync_err, *_hb_fra_s, *_hb_lat_p50, *_hb_lat_p99;
   Gtk::Image *_hb_is_sync;
   Gtk::HeaderBar *_hb;
+  Gtk::Scale *_replay_seek;
   Gtk::Notebook *_notebook;
 
   enum EntryWidgets {
@@ -101,38 +122,44 @@ private:
 
   Gtk::Entry *_entry[E_COUNT];
   Gtk::Arrow *_flag[F_COUNT];
+  /// Values shown by _entry and _flag, so that only those widgets whose value changed are touched; NaN and -1 until set
+  double _entry_value[E_COUNT];
+  signed char _flag_value[F_COUNT];
 
   std::vector<CairoGauge> _gauge = {
-      {"RPM", [](void *p) { return static_cast<XR25Frame *>(p)->rpm; }, 7000, 500, 2},
-      {"km/h", [](void *p) { return static_cast<XR25Frame *>(p)->spd_km_h; }, 240, 10, 2},
-      {"Temp (C)", [](void *p) { return static_cast<XR25Frame *>(p)->temp_water; }, 120, 30, 1},
-      {"Battery (V)", [](void *p) { return static_cast<XR25Frame *>(p)->battvalue; }, 18, 1, 2},
-      {"MAP (mbar)", [](void *p) { return static_cast<XR25Frame *>(p)->map; }, 1020, 255, 1},
-      {"Air Temp(C)", [](void *p) { return static_cast<XR25Frame *>(p)->temp_air; }, 90, 30, 1},
-      {"Lambda (mV)", [](void *p) { return static_cast<XR25Frame *>(p)->lambdavalue; }, 1530, 255, 1},
+      {"RPM", [](void *p) { return static_cast<XR25Frame *>(p)->rpm; }, 7000, 500, 2, FIELD_rpm},
+      {"km/h", [](void *p) { return static_cast<XR25Frame *>(p)->spd_km_h; }, 240, 10, 2, FIELD_spd_km_h},
+      {"Temp (C)", [](void *p) { return static_cast<XR25Frame *>(p)->temp_water; }, 120, 30, 1, FIELD_temp_water},
+      {"Battery (V)", [](void *p) { return static_cast<XR25Frame *>(p)->battvalue; }, 18, 1, 2, FIELD_battvalue},
+      {"MAP (mbar)", [](void *p) { return static_cast<XR25Frame *>(p)->map; }, 1020, 255, 1, FIELD_map},
+      {"Air Temp(C)", [](void *p) { return static_cast<XR25Frame *>(p)->temp_air; }, 90, 30, 1, FIELD_temp_air},
+      {"Lambda (mV)", [](void *p) { return static_cast<XR25Frame *>(p)->lambdavalue; }, 1530, 255, 1,
+       FIELD_lambdavalue},
   };
   std::vector<CairoTSPlot> _plot = {
-      {"RPM", [](void *p, bool &is_alerted) { return static_cast<XR25Frame *>(p)->rpm; }, 0, 6000, 1500},
-      {"MAP (mbar)", [](void *p, bool &is_alerted) { return static_cast<XR25Frame *>(p)->map; }, 0, 1020, 255},
+      {"RPM", [](void *p, bool &is_alerted) { return static_cast<XR25Frame *>(p)->rpm; }, 0, 6000, 1500, FIELD_rpm},
+      {"MAP (mbar)", [](void *p, bool &is_alerted) { return static_cast<XR25Frame *>(p)->map; }, 0, 1020, 255,
+       FIELD_map},
       {"Throttle",
        [](void *p, bool &is_alerted) {
          is_alerted = static_cast<XR25Frame *>(p)->in_flags & IN_THROTTLE_0;
          return static_cast<XR25Frame *>(p)->throttle;
        },
-       0, 100, 20},
+       0, 100, 20, FIELD_throttle | FIELD_in_flags},
       {"Lambda (mV)",
        [](void *p, bool &is_alerted) {
          is_alerted = ~static_cast<XR25Frame *>(p)->out_flags & OUT_LAMBDA_LOOP;
          return static_cast<XR25Frame *>(p)->lambdavalue;
        },
-       0, 1020, 255},
+       0, 1020, 255, FIELD_lambdavalue | FIELD_out_flags},
       {"Battery (V)",
        [](void *p, bool &is_alerted) {
          is_alerted = static_cast<XR25Frame *>(p)->battvalue > 15;
          return static_cast<XR25Frame *>(p)->battvalue;
        },
-       8, 16, 2},
-      {"Temp (C)", [](void *p, bool &is_alerted) { return static_cast<XR25Frame *>(p)->temp_water; }, 0, 120, 30},
+       8, 16, 2, FIELD_battvalue},
+      {"Temp (C)", [](void *p, bool &is_alerted) { return static_cast<XR25Frame *>(p)->temp_water; }, 0, 120, 30,
+       FIELD_temp_water},
   };
 
   enum { GRID_DASHBOARD = 0, GRID_PLOTS, _GRID_COUNT };
@@ -175,22 +202,37 @@ private:
   void update_page_diagnostic(XR25Frame &);
   void update_page_dashboard(XR25Frame &);
   void update_page_plots(XR25Frame &);
-  /** Update current notebook page, see 'update_page_xxx()' member
-   * functions; called UI_UPDATE_PAGE_HZ times per sec.
+  /** Consume all the frames in _frame_ring and update current notebook
+   * page, see 'update_page_xxx()' member functions; called
+   * UI_UPDATE_PAGE_HZ times per sec.
    */
   bool update_page();
 
-  /** Update headerbar widgets; called UI_UPDATE_HEADER_HZ times per sec
+  /** Update headerbar widgets; called UI_UPDATE_HEADER_HZ times per sec.
+   * Latency percentiles are computed over the last period and reset.
    */
   bool update_header();
 
+  /// Show and connect the replay controls in the headerbar; only if _replay is set
+  void setup_replay_controls();
+
 public:
   /// The update frequency for notebook pages in the main window
   static constexpr unsigned UI_UPDATE_PAGE_HZ = 16;
   /// The update frequency for widgets embedded in the window decoration
   static constexpr unsigned UI_UPDATE_HEADER_HZ = 1;
-
-  UI(Glib::RefPtr<Gtk::Application> _a, Glib::RefPtr<Gtk::Builder> _b, std::istream &_is, const XR25FrameParser &_p);
+  /// Plot samples held at full resolution (over 4 minutes at the nominal frame rate); older ones are held as rollups
+  static constexpr size_t PLOT_HISTORY_SAMPLES = 1 << 16;
+
+  /** Construct the main window
+   * @param _fd File descriptor to read frames from; if @a _r is set, it should be _r->get_fd()
+   * @param _tee, _tee_ts, _tee_rec See XR25StreamReader::XR25StreamReader()
+   * @param _plot_window Time span, in seconds, initially shown by the plots
+   * @param _r If not nullptr, the replay engine is started by run() and controlled from the headerbar
+   */
+  UI(Glib::RefPtr<Gtk::Application> _a, Glib::RefPtr<Gtk::Builder> _b, int _fd, std::ostream *_tee,
+     std::ostream *_tee_ts, XR25RecordingWriter *_tee_rec, const XR25FrameParser &_p, unsigned _plot_window,
+     XR25Replay *_r = nullptr);
   ~UI() {}
 
   void run();
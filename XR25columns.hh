@@ -0,0 +1,68 @@
+/* XR25columns.hh - Column-wise storage of parsed XR25 frames
+ *
+ * Copyright (C) Javier Lopez-Gomez, 2016
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef XR25COLUMNS_HH
+#define XR25COLUMNS_HH
+
+#include "XR25streamreader.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+/// Parsed frames, stored as one contiguous array per field of XR25Frame (see XR25FRAME_FIELDS), e.g. `rpm[i]` is the
+/// RPM of the i-th frame.  Filled by XR25FrameParser::parse_batch(); rows added by resize() are zeroed.
+struct XR25FrameColumns {
+#define X(_f) std::vector<std::remove_cv<decltype(XR25Frame::_f)>::type> _f;
+  XR25FRAME_FIELDS(X)
+#undef X
+  /// Whether each frame had the length expected by the parser, i.e. the return value of parse_frame()
+  std::vector<unsigned char> valid;
+  /// Offset of the header of each frame in the input, if known; set by XR25MmapReader::decode()
+  std::vector<uint64_t> offset;
+
+  size_t size() const { return valid.size(); }
+
+  void resize(size_t n) {
+#define X(_f) _f.resize(n);
+    XR25FRAME_FIELDS(X)
+#undef X
+    valid.resize(n), offset.resize(n);
+  }
+
+  void reserve(size_t n) {
+#define X(_f) _f.reserve(n);
+    XR25FRAME_FIELDS(X)
+#undef X
+    valid.reserve(n), offset.reserve(n);
+  }
+
+  void clear() {
+#define X(_f) _f.clear();
+    XR25FRAME_FIELDS(X)
+#undef X
+    valid.clear(), offset.clear();
+  }
+
+  /// Store @a fra in row @a i
+  void set_row(size_t i, const XR25Frame &fra) {
+#define X(_f) _f[i] = fra._f;
+    XR25FRAME_FIELDS(X)
+#undef X
+  }
+};
+
+#endif /* XR25COLUMNS_HH */
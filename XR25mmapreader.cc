@@ -0,0 +1,230 @@
+/* XR25mmapreader.cc - Parallel decoding of memory-mapped XR25 capture files
+ *
+ * Copyright (C) Javier Lopez-Gomez, 2016
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "XR25mmapreader.hh"
+#include "Parsers.hh"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+
+XR25MmapReader::XR25MmapReader(const std::string &pathname) : _base(nullptr), _size(0), _errors() {
+  struct stat st;
+  int fd = open(pathname.c_str(), O_RDONLY);
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    int err = errno;
+    if (fd != -1)
+      close(fd);
+    throw std::system_error(err, std::generic_category(), pathname);
+  }
+
+  if ((_size = st.st_size) != 0) {
+    void *p = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      int err = errno;
+      close(fd);
+      throw std::system_error(err, std::generic_category(), "mmap() " + pathname);
+    }
+    madvise(p, _size, MADV_SEQUENTIAL);
+    _base = static_cast<const unsigned char *>(p);
+  }
+  close(fd);
+}
+
+XR25MmapReader::~XR25MmapReader() {
+  if (_base)
+    munmap(const_cast<unsigned char *>(_base), _size);
+}
+
+size_t XR25MmapReader::find_header(size_t offset) const {
+  const unsigned char *p = _base + offset, *end = _base + _size;
+  while (p + 1 < end) {
+    auto q = static_cast<const unsigned char *>(std::memchr(p + 1, 0x00, end - p - 1));
+    if (!q)
+      break;
+    // count the 0xff octets that precede the 0x00
+    const unsigned char *r = q;
+    while (r > _base && r[-1] == 0xff)
+      --r;
+    if ((q - r) & 1)
+      return (q - 1) - _base;
+    p = q;
+  }
+  return _size;
+}
+
+std::vector<size_t> XR25MmapReader::split(size_t chunk_size) const {
+  std::vector<size_t> ret{0};
+  for (size_t offset = chunk_size; offset < _size; offset += chunk_size) {
+    size_t h = find_header(std::max(offset, ret.back() + 1));
+    if (h >= _size)
+      break;
+    if (h > ret.back())
+      ret.push_back(h);
+    offset = std::max(offset, h);
+  }
+  ret.push_back(_size);
+  return ret;
+}
+
+XR25Deframer XR25MmapReader::probe(size_t offset) const {
+  for (size_t size = PROBE_SIZE;; size *= 2) {
+    // also feed the header at offset, so that the frame before it is delivered
+    size_t begin = (offset > size) ? find_header(offset - size) : 0, end = std::min(offset + 2, _size);
+    XR25Deframer ret;
+    ret.feed(_base + begin, end - begin, [](const unsigned char[], int) {});
+    if (ret.get_nominal_length() || begin == 0)
+      return ret;
+  }
+}
+
+unsigned long XR25MmapReader::decode(const std::string &parser_t, unsigned nthreads, chunk_fn_t fn,
+                                     size_t chunk_size) {
+  struct chunk_result {
+    XR25FrameColumns frames;
+    XR25DeframerErrors errors{};
+    bool done = false;
+  };
+  const auto bounds = split(chunk_size);
+  const size_t nchunks = bounds.size() - 1;
+  std::vector<chunk_result> results(nchunks);
+  std::vector<XR25FrameColumns> spare; /* columns of chunks already delivered, reused to avoid page faults */
+  std::mutex m;
+  std::condition_variable cv;
+  size_t next = 0, emitted = 0;
+  bool stop = false; /* set if fn throws, so that the workers give up */
+  unsigned long frame_no = 0;
+
+  // an AutoDetectParser per worker would score whichever chunks it gets; detect the layout once, from the start
+  std::string worker_parser_t = parser_t;
+  _parser = ParserFactory::create(parser_t);
+  if (auto p = dynamic_cast<AutoDetectParser *>(_parser.get())) {
+    XR25Deframer deframer;
+    XR25ChangeDetector detector;
+    XR25Frame fra{};
+    for (size_t offset = 0; offset < _size && p->get_detected_type().empty();
+         offset += XR25StreamReader::READ_BLOCK_SIZE)
+      deframer.feed(_base + offset, std::min(XR25StreamReader::READ_BLOCK_SIZE, _size - offset),
+                    [&](const unsigned char c[], int l) { detector.parse(*p, c, l, fra); });
+    worker_parser_t = p->get_leading_type();
+  }
+
+  nthreads = std::max(nthreads, 1U);
+  auto worker = [&]() {
+    auto parser = ParserFactory::create(worker_parser_t);
+    for (;;) {
+      size_t k;
+      {
+        // do not get too far ahead of the consumer, so that memory usage stays bounded
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [&]() { return stop || next >= nchunks || next < emitted + 2 * nthreads; });
+        if (stop || next >= nchunks)
+          return;
+        k = next++;
+        if (!spare.empty()) {
+          std::swap(results[k].frames, spare.back());
+          spare.pop_back();
+        }
+      }
+
+      // also feed the header of the next chunk, so that the last frame in this chunk is delivered
+      size_t begin = bounds[k], end = std::min(bounds[k + 1] + 2, _size);
+      // frames are parsed in batches of BATCH; parsers may read past the end of short frames, so each frame is kept
+      // along with the rest of the deframer buffer, as a serial decode would see it
+      constexpr size_t BATCH = 64;
+      constexpr int N = XR25Deframer::MAX_FRAME_LENGTH;
+      unsigned char data[BATCH][N];
+      int length[BATCH];
+      uint64_t offset[BATCH];
+      size_t pending = 0;
+      // the first chunk is deframed from scratch, as in a serial decode
+      XR25Deframer deframer;
+      if (k > 0)
+        deframer.learn_from(probe(begin));
+      XR25FrameColumns &cols = results[k].frames;
+      auto flush = [&]() {
+        size_t first = cols.size();
+        cols.resize(first + pending);
+        parser->parse_batch(data[0], N, length, pending, cols, first);
+        std::copy(offset, offset + pending, &cols.offset[first]);
+        pending = 0;
+      };
+      cols.reserve((end - begin) / 32);
+      deframer.feed(_base + begin, end - begin, [&](const unsigned char c[], int l) {
+        std::memcpy(data[pending], c, N);
+        length[pending] = l, offset[pending] = begin + deframer.get_frame_offset();
+        if (++pending == BATCH)
+          flush();
+      });
+      flush();
+
+      std::lock_guard<std::mutex> lock(m);
+      results[k].errors = deframer.get_errors();
+      results[k].done = true;
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  _errors = XR25DeframerErrors{};
+  try {
+    for (unsigned i = 0; i < nthreads; ++i)
+      threads.emplace_back(worker);
+
+    for (size_t k = 0; k < nchunks; ++k) {
+      XR25FrameColumns frames;
+      {
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [&]() { return results[k].done; });
+        std::swap(frames, results[k].frames);
+        _errors.overflow += results[k].errors.overflow;
+        _errors.short_frame += results[k].errors.short_frame;
+        _errors.bad_escape += results[k].errors.bad_escape;
+      }
+      if (frames.size())
+        fn(frame_no, frames);
+      frame_no += frames.size();
+      frames.clear();
+      {
+        std::lock_guard<std::mutex> lock(m);
+        spare.push_back(std::move(frames));
+        emitted = k + 1;
+      }
+      cv.notify_all();
+    }
+  } catch (...) {
+    // joinable threads must not be destroyed; workers finish the chunk at hand and then see `stop`
+    {
+      std::lock_guard<std::mutex> lock(m);
+      stop = true;
+    }
+    cv.notify_all();
+    for (auto &i : threads)
+      i.join();
+    throw;
+  }
+  for (auto &i : threads)
+    i.join();
+  return frame_no;
+}
@@ -0,0 +1,95 @@
+/* XR25mmapreader.hh - Parallel decoding of memory-mapped XR25 capture files
+ *
+ * Copyright (C) Javier Lopez-Gomez, 2016
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef XR25MMAPREADER_HH
+#define XR25MMAPREADER_HH
+
+#include "XR25columns.hh"
+#include "XR25streamreader.hh"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// Decode a raw capture file using several threads.  The file is memory-mapped and split in chunks that start at a
+/// frame header; each chunk is deframed and parsed, as a batch (see XR25FrameParser::parse_batch()), by a worker thread
+/// and the parsed frames are then delivered in file order, one chunk at a time.
+class XR25MmapReader {
+public:
+  typedef std::function<void(unsigned long, const XR25FrameColumns &)> chunk_fn_t;
+
+  /// Default size of the chunks handed to worker threads
+  static constexpr size_t CHUNK_SIZE = 1 << 20;
+  /// Octets deframed before a chunk to learn the nominal frame length, at first; see probe()
+  static constexpr size_t PROBE_SIZE = 4096;
+
+private:
+  const unsigned char *_base;
+  size_t _size;
+  XR25DeframerErrors _errors;
+  std::shared_ptr<XR25FrameParser> _parser; /* created by decode() from its parser_t */
+
+  /** Deframe the octets that precede @a offset, going as far back as needed to learn the nominal frame length
+   * @param offset Offset of a frame header
+   * @return A deframer in the state that a serial decode would have reached at @a offset
+   */
+  XR25Deframer probe(size_t offset) const;
+
+public:
+  /** Map a capture file into memory; throws std::system_error on failure
+   * @param pathname Path of the capture file
+   */
+  XR25MmapReader(const std::string &pathname);
+  ~XR25MmapReader();
+  XR25MmapReader(const XR25MmapReader &) = delete;
+  XR25MmapReader &operator=(const XR25MmapReader &) = delete;
+
+  size_t get_size() const { return _size; }
+  const unsigned char *get_data() const { return _base; }
+  int get_sync_err_count() const { return _errors.total(); }
+  /// Frames dropped by the deframer during the last decode(), by cause
+  const XR25DeframerErrors &get_errors() const { return _errors; }
+  /// Parser created by the last decode() from its `parser_t`; an AutoDetectParser has detected the layout by then
+  const XR25FrameParser &get_parser() const { return *_parser; }
+
+  /** Find the first frame header at or after @a offset.  A 0x00 octet preceded by a run of 0xff octets is a header
+   * only if the run has odd length; otherwise, it is an escaped 0xff followed by a 0x00 data octet.
+   * @return Offset of the 0xff octet that starts the header, or the size of the file if none was found
+   */
+  size_t find_header(size_t offset) const;
+
+  /** Split the file in chunks of approximately @a chunk_size octets, aligned on frame headers
+   * @return Offsets of the start of each chunk, followed by the size of the file
+   */
+  std::vector<size_t> split(size_t chunk_size = CHUNK_SIZE) const;
+
+  /** Decode all the frames in the file.  Each chunk other than the first starts with the nominal frame length (see
+   * XR25Deframer) learned from the octets before it, so that it rejects frames of the wrong length from its first
+   * frame on, even if the ECU changed the frame length in an earlier chunk
+   * @param parser_t Parser typename, as registered in ParserFactory; each worker thread creates its own parser.  An
+   *     AutoDetectParser is run once, on the start of the file as a serial decode would, and the workers use the parser
+   *     that it detects (or its leader, if the file ends first), so that all the chunks are decoded with one layout
+   * @param nthreads Number of worker threads
+   * @param fn Called, in file order and from the calling thread, for each chunk along with the sequence number of its
+   *     first frame; if it throws, the worker threads are stopped and joined before the exception is propagated
+   * @param chunk_size See split()
+   * @return Number of frames decoded
+   */
+  unsigned long decode(const std::string &parser_t, unsigned nthreads, chunk_fn_t fn,
+                       size_t chunk_size = CHUNK_SIZE);
+};
+
+#endif /* XR25MMAPREADER_HH */
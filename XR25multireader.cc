@@ -0,0 +1,141 @@
+/* XR25multireader.cc - Read XR25 frame streams from several ports in one thread
+ *
+ * Copyright (C) Javier Lopez-Gomez, 2016
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "XR25multireader.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <system_error>
+#include <type_traits>
+#include <unistd.h>
+
+/// epoll_event.data.u32 value that identifies the stop eventfd
+static constexpr uint32_t STOP_EVFD_INDEX = UINT32_MAX;
+
+XR25MultiReader::XR25MultiReader(post_parse_t p)
+    : _epfd(epoll_create1(EPOLL_CLOEXEC)), _stop_evfd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)), _post_parse(p),
+      _thrd(nullptr), _running(0) {
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN, ev.data.u32 = STOP_EVFD_INDEX;
+  if (_epfd == -1 || _stop_evfd == -1 || epoll_ctl(_epfd, EPOLL_CTL_ADD, _stop_evfd, &ev) == -1) {
+    int err = errno;
+    if (_epfd != -1)
+      close(_epfd);
+    if (_stop_evfd != -1)
+      close(_stop_evfd);
+    throw std::system_error(err, std::generic_category(), "XR25MultiReader");
+  }
+}
+
+XR25MultiReader::~XR25MultiReader() {
+  stop();
+  close(_epfd);
+  close(_stop_evfd);
+}
+
+unsigned XR25MultiReader::add_port(int fd, ParserFactory::parser_ptr_t parser) {
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN, ev.data.u32 = _ports.size();
+  if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    throw std::system_error(errno, std::generic_category(), "epoll_ctl()");
+  _ports.emplace_back(std::make_unique<port_state>(fd, parser));
+  return ev.data.u32;
+}
+
+void XR25MultiReader::start() {
+  if (!_thrd) {
+    _running = 1;
+    _thrd = std::make_unique<std::thread>([this]() {
+      this->read_frames();
+      _running = 0;
+    });
+  }
+}
+
+void XR25MultiReader::stop() {
+  if (_thrd) {
+    uint64_t v = 1;
+    while (write(_stop_evfd, &v, sizeof(v)) == -1 && errno == EINTR)
+      ;
+    _thrd->join();
+    _thrd.reset();
+    while (read(_stop_evfd, &v, sizeof(v)) == -1 && errno == EINTR)
+      ;
+  }
+}
+
+bool XR25MultiReader::read_port(unsigned index) {
+  unsigned char buf[XR25StreamReader::READ_BLOCK_SIZE];
+  port_state &port = *_ports[index];
+
+  ssize_t n = read(port.fd, buf, sizeof(buf));
+  auto timestamp = std::chrono::steady_clock::now();
+  if (n == 0 || (n == -1 && errno != EINTR && errno != EAGAIN))
+    return false;
+  if (n > 0) {
+    port.deframer.feed(
+        buf, n,
+        [&](const unsigned char c[], int length) {
+          port.fra.timestamp = port.deframer.get_frame_timestamp();
+          port.fra_count++, port.count++;
+          port.detector.parse(*port.parser, c, length, port.fra);
+          if (_post_parse)
+            _post_parse(index, c, length, port.fra);
+        },
+        timestamp);
+    port.synchronized = port.deframer.is_synchronized();
+    port.sync_err_count = port.deframer.get_sync_err_count();
+  }
+  return true;
+}
+
+void XR25MultiReader::read_frames() {
+  typedef std::chrono::steady_clock clock;
+  struct epoll_event events[16];
+  auto next_stat = clock::now() + std::chrono::seconds(1);
+  unsigned active = std::count_if(_ports.begin(), _ports.end(), [](auto &i) { return !i->eof; });
+
+  while (active) {
+    // wake up at least once a second to update frames_per_sec
+    auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(next_stat - clock::now()).count();
+    int nev = epoll_wait(_epfd, events, std::extent<decltype(events)>::value, std::max<int>(timeout, 0));
+    if (nev == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    for (int i = 0; i < nev; ++i) {
+      uint32_t index = events[i].data.u32;
+      if (index == STOP_EVFD_INDEX)
+        return;
+      if (!read_port(index)) {
+        epoll_ctl(_epfd, EPOLL_CTL_DEL, _ports[index]->fd, nullptr);
+        _ports[index]->eof = 1, active--;
+      }
+    }
+
+    auto now = clock::now();
+    if (now >= next_stat) {
+      for (auto &i : _ports)
+        i->frames_per_sec = i->count, i->count = 0;
+      next_stat = now + std::chrono::seconds(1);
+    }
+  }
+}
@@ -0,0 +1,103 @@
+/* XR25multireader.hh - Read XR25 frame streams from several ports in one thread
+ *
+ * Copyright (C) Javier Lopez-Gomez, 2016
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef XR25MULTIREADER_HH
+#define XR25MULTIREADER_HH
+
+#include "Parsers.hh"
+#include "XR25streamreader.hh"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+/// Multiplexes several input file descriptors (e.g. one tty per ECU) on a single epoll loop.  Each port has its own
+/// deframer, parser and counters; the number of threads does not depend on the number of ports.
+class XR25MultiReader {
+private:
+  typedef std::function<void(unsigned, const unsigned char[], int, XR25Frame &)> post_parse_t;
+
+  struct port_state {
+    int fd;
+    ParserFactory::parser_ptr_t parser;
+    XR25Deframer deframer;
+    XR25ChangeDetector detector;
+    XR25Frame fra;
+    bool eof;
+    int count; /* frames received in the current second */
+    std::atomic_bool synchronized;
+    std::atomic_int sync_err_count, frames_per_sec, fra_count;
+
+    port_state(int _fd, ParserFactory::parser_ptr_t _p)
+        : fd(_fd), parser(_p), fra(), eof(0), count(0), synchronized(0), sync_err_count(0), frames_per_sec(0),
+          fra_count(0) {}
+  };
+
+  int _epfd, _stop_evfd; /* epoll instance; eventfd that is signaled by stop() */
+  std::vector<std::unique_ptr<port_state>> _ports;
+  post_parse_t _post_parse;
+  std::unique_ptr<std::thread> _thrd;
+  std::atomic_bool _running;
+
+  /** Read and deframe one block from port @a index
+   * @return false if the end of the input was reached
+   */
+  bool read_port(unsigned index);
+  void read_frames();
+
+public:
+  /** Construct a XR25MultiReader object; throws std::system_error if the epoll instance or the wake-up eventfd
+   * cannot be created
+   * @param p Called after a frame has been parsed; the first argument is the port index, see add_port().  See also
+   *     XR25Frame::changed
+   */
+  XR25MultiReader(post_parse_t p = nullptr);
+  ~XR25MultiReader();
+  XR25MultiReader(const XR25MultiReader &) = delete;
+  XR25MultiReader &operator=(const XR25MultiReader &) = delete;
+
+  /** Add an input port; ports may only be added while the reader is stopped.  Throws std::system_error on failure.
+   * @param fd File descriptor to read from, e.g. a tty or a pipe (regular files cannot be polled); it is not closed by
+   *     the destructor
+   * @param parser The XR25FrameParser to use for this port
+   * @return The index of the new port
+   */
+  unsigned add_port(int fd, ParserFactory::parser_ptr_t parser);
+  unsigned get_port_count() const { return _ports.size(); }
+
+  bool is_synchronized(unsigned index) { return _ports[index]->synchronized.load(); }
+  int get_sync_err_count(unsigned index) { return _ports[index]->sync_err_count.load(); }
+  int get_frames_per_sec(unsigned index) { return _ports[index]->frames_per_sec.load(); }
+  int get_fra_count(unsigned index) { return _ports[index]->fra_count.load(); }
+
+  /// Whether the internal thread is still reading, i.e. stop() was not called and some input has not reached its end
+  bool is_running() { return _running.load(); }
+
+  /** Read frames non-blocking; call stop() to terminate thread
+   */
+  void start();
+
+  /** Read frames in the calling thread until the end of all the inputs is reached
+   */
+  void run() { read_frames(); }
+
+  /** Wake up and join the internal thread; see start()
+   */
+  void stop();
+};
+
+#endif /* XR25MULTIREADER_HH */
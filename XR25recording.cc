@@ -0,0 +1,333 @@
+/* XR25recording.cc - Indexed XR25 recording container
+ *
+ * Copyright (C) Javier Lopez-Gomez, 2016
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "XR25recording.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <endian.h>
+#include <fstream>
+#include <system_error>
+
+static constexpr char HEADER_MAGIC[] = "XR25REC1", TRAILER_MAGIC[] = "XR25IDX1";
+static constexpr size_t MAGIC_SIZE = 8;
+static constexpr uint32_t VERSION = 2;
+static constexpr size_t HEADER_SIZE = 64, CODEC_OFFSET = 16, PARSER_T_OFFSET = 20, PARSER_T_SIZE = HEADER_SIZE - 20;
+static constexpr size_t V1_PARSER_T_OFFSET = 16, V1_PARSER_T_SIZE = HEADER_SIZE - 16;
+static constexpr size_t RECORD_HEADER_SIZE = 9, BLOCK_HEADER_SIZE = 16, INDEX_ENTRY_SIZE = 16, TRAILER_SIZE = 24;
+
+static inline void put_le32(unsigned char *p, uint32_t v) {
+  v = htole32(v);
+  std::memcpy(p, &v, sizeof(v));
+}
+
+static inline void put_le64(unsigned char *p, uint64_t v) {
+  v = htole64(v);
+  std::memcpy(p, &v, sizeof(v));
+}
+
+static inline uint32_t get_le32(const unsigned char *p) {
+  uint32_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return le32toh(v);
+}
+
+static inline uint64_t get_le64(const unsigned char *p) {
+  uint64_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return le64toh(v);
+}
+
+void XR25DeltaCodec::reset(uint64_t time_ns) {
+  _m = model();
+  std::memset(_prev, 0, sizeof(_prev));
+  std::memset(_changed, 0, sizeof(_changed));
+  _length = 0, _time_ns = time_ns, _dt_ns = 0;
+}
+
+void XR25DeltaCodec::encode(RangeEncoder &rc, const unsigned char c[], int length, uint64_t time_ns) {
+  rc.encode(_m.length_changed, length != _length);
+  if (length != _length)
+    rc.encode(_m.length, length);
+
+  // the change in the inter-frame time is 0 or small, i.e. the jitter, for a steady frame rate
+  uint64_t dt = time_ns - _time_ns, d = dt - _dt_ns;
+  rc.encode(_m.dt_changed, d != 0);
+  if (d != 0) {
+    bool negative = static_cast<int64_t>(d) < 0;
+    uint64_t a = negative ? -d : d;
+    unsigned nbits = 64 - __builtin_clzll(a);
+    rc.encode(_m.dt_sign, negative);
+    rc.encode(_m.dt_bits, nbits - 1);
+    rc.encode_direct(a, nbits - 1); /* the MSB is implied */
+  }
+
+  for (int i = 0; i < length; ++i) {
+    unsigned char delta = c[i] - _prev[i];
+    unsigned changed = delta != 0;
+    rc.encode(_m.changed[i][_changed[i]], changed);
+    if (changed)
+      rc.encode(_m.delta[i], delta);
+    _prev[i] = c[i], _changed[i] = changed;
+  }
+  _length = length, _time_ns = time_ns, _dt_ns = dt;
+}
+
+int XR25DeltaCodec::decode(RangeDecoder &rc, unsigned char c[], uint64_t &time_ns) {
+  if (rc.decode(_m.length_changed))
+    _length = std::min<int>(rc.decode(_m.length), N);
+
+  uint64_t d = 0;
+  if (rc.decode(_m.dt_changed)) {
+    bool negative = rc.decode(_m.dt_sign);
+    unsigned nbits = rc.decode(_m.dt_bits) + 1;
+    uint64_t a = (UINT64_C(1) << (nbits - 1)) | rc.decode_direct(nbits - 1);
+    d = negative ? -a : a;
+  }
+  _dt_ns += d, _time_ns += _dt_ns;
+
+  for (int i = 0; i < _length; ++i) {
+    unsigned changed = rc.decode(_m.changed[i][_changed[i]]);
+    if (changed)
+      _prev[i] += rc.decode(_m.delta[i]);
+    c[i] = _prev[i], _changed[i] = changed;
+  }
+  time_ns = _time_ns;
+  return _length;
+}
+
+XR25RecordingWriter::XR25RecordingWriter(const std::string &pathname, const std::string &parser_t,
+                                         bool drop_when_full, XR25RecordingCodec codec)
+    : _buf(drop_when_full), _os(&_buf), _codec(codec), _offset(0), _frame_count(0), _rc(_block), _block_frames(0),
+      _block_time_ns(0) {
+  if (!_buf.open(pathname))
+    throw std::system_error(errno, std::generic_category(), pathname);
+  if (_codec == CODEC_DELTA)
+    _delta = std::make_unique<XR25DeltaCodec>();
+
+  unsigned char hdr[HEADER_SIZE] = {};
+  std::memcpy(hdr, HEADER_MAGIC, MAGIC_SIZE);
+  put_le32(hdr + 8, VERSION), put_le32(hdr + 12, (_codec == CODEC_DELTA) ? BLOCK_INTERVAL : INDEX_INTERVAL);
+  put_le32(hdr + CODEC_OFFSET, _codec);
+  std::strncpy(reinterpret_cast<char *>(hdr + PARSER_T_OFFSET), parser_t.c_str(), PARSER_T_SIZE - 1);
+  _os.write(reinterpret_cast<char *>(hdr), sizeof(hdr));
+  _offset = sizeof(hdr);
+}
+
+void XR25RecordingWriter::write_frame(const unsigned char c[], int length, uint64_t time_ns) {
+  unsigned char rec[RECORD_HEADER_SIZE + XR25Deframer::MAX_FRAME_LENGTH];
+  length = std::min(length, XR25Deframer::MAX_FRAME_LENGTH);
+  if (_codec == CODEC_DELTA) {
+    if (_block_frames == 0) {
+      _block.assign(BLOCK_HEADER_SIZE, 0);
+      _rc.reset();
+      _delta->reset(time_ns);
+      _block_time_ns = time_ns;
+    }
+    _delta->encode(_rc, c, length, time_ns);
+    if (++_block_frames == BLOCK_INTERVAL)
+      write_block();
+    return;
+  }
+
+  rec[0] = length;
+  put_le64(rec + 1, time_ns);
+  std::memcpy(rec + RECORD_HEADER_SIZE, c, length);
+
+  // a record dropped by _buf (the disk did not keep up) is left out of the index as well
+  uint64_t dropped = _buf.get_dropped_count();
+  _os.write(reinterpret_cast<char *>(rec), RECORD_HEADER_SIZE + length);
+  if (_buf.get_dropped_count() != dropped)
+    return;
+  if (_frame_count++ % INDEX_INTERVAL == 0)
+    _index.push_back({_offset, time_ns});
+  _offset += RECORD_HEADER_SIZE + length;
+}
+
+void XR25RecordingWriter::write_block() {
+  if (_block_frames == 0)
+    return;
+  _rc.flush();
+  put_le32(&_block[0], _block.size() - BLOCK_HEADER_SIZE), put_le32(&_block[4], _block_frames);
+  put_le64(&_block[8], _block_time_ns);
+
+  // as for records, a block dropped by _buf is left out of the index
+  uint64_t dropped = _buf.get_dropped_count();
+  _os.write(reinterpret_cast<char *>(_block.data()), _block.size());
+  if (_buf.get_dropped_count() == dropped) {
+    _index.push_back({_offset, _block_time_ns});
+    _frame_count += _block_frames, _offset += _block.size();
+  }
+  _block_frames = 0;
+}
+
+void XR25RecordingWriter::close() {
+  if (!_buf.is_open())
+    return;
+  write_block();
+  unsigned char buf[TRAILER_SIZE];
+  for (auto &i : _index) {
+    put_le64(buf, i.offset), put_le64(buf + 8, i.time_ns);
+    _os.write(reinterpret_cast<char *>(buf), INDEX_ENTRY_SIZE);
+  }
+  put_le64(buf, _offset), put_le64(buf + 8, _frame_count);
+  std::memcpy(buf + 16, TRAILER_MAGIC, MAGIC_SIZE);
+  _os.write(reinterpret_cast<char *>(buf), TRAILER_SIZE);
+  if (!_buf.close())
+    _os.setstate(std::ios_base::badbit);
+}
+
+XR25RecordingReader::XR25RecordingReader(const std::string &pathname)
+    : _file(pathname), _codec(CODEC_NONE), _index_interval(0), _frame_count(0), _cursor_frame(UINT64_MAX),
+      _cursor_offset(0), _cached_block(UINT64_MAX) {
+  const unsigned char *base = _file.get_data();
+  const size_t size = _file.get_size();
+  uint32_t version = 0;
+  if (size < HEADER_SIZE || std::memcmp(base, HEADER_MAGIC, MAGIC_SIZE) != 0 ||
+      ((version = get_le32(base + 8)) != 1 && version != VERSION) || (_index_interval = get_le32(base + 12)) == 0 ||
+      (version == VERSION && get_le32(base + CODEC_OFFSET) > CODEC_DELTA))
+    throw std::system_error(EINVAL, std::generic_category(), pathname);
+  const char *p = reinterpret_cast<const char *>(base + ((version == 1) ? V1_PARSER_T_OFFSET : PARSER_T_OFFSET));
+  _parser_t.assign(p, strnlen(p, (version == 1) ? V1_PARSER_T_SIZE : PARSER_T_SIZE));
+  if (version == VERSION && (_codec = static_cast<XR25RecordingCodec>(get_le32(base + CODEC_OFFSET))) == CODEC_DELTA)
+    _delta = std::make_unique<XR25DeltaCodec>();
+
+  // use the index if the trailer is consistent; otherwise, scan the records, up to the index if there is one
+  size_t end = size;
+  if (size >= HEADER_SIZE + TRAILER_SIZE && std::memcmp(base + size - MAGIC_SIZE, TRAILER_MAGIC, MAGIC_SIZE) == 0) {
+    const unsigned char *trailer = base + size - TRAILER_SIZE;
+    uint64_t index_offset = get_le64(trailer), frame_count = get_le64(trailer + 8);
+    uint64_t nentries = (frame_count + _index_interval - 1) / _index_interval;
+    if (index_offset >= HEADER_SIZE && index_offset <= size - TRAILER_SIZE &&
+        (size - TRAILER_SIZE - index_offset) == nentries * INDEX_ENTRY_SIZE) {
+      // entries must point at increasing offsets within the records; otherwise, the index is not trusted
+      uint64_t last = 0;
+      _index.reserve(nentries);
+      for (const unsigned char *q = base + index_offset; q < trailer; q += INDEX_ENTRY_SIZE) {
+        uint64_t offset = get_le64(q);
+        if (offset < HEADER_SIZE || offset >= index_offset || offset <= last)
+          break;
+        _index.push_back({offset, get_le64(q + 8)});
+        last = offset;
+      }
+      if (_index.size() == nentries) {
+        _frame_count = frame_count;
+        return;
+      }
+      _index.clear();
+      end = index_offset;
+    }
+  }
+  rebuild_index(HEADER_SIZE, end);
+}
+
+bool XR25RecordingReader::is_recording(const std::string &pathname) {
+  char magic[MAGIC_SIZE];
+  std::ifstream is(pathname, std::ios_base::binary);
+  return is.read(magic, sizeof(magic)) && std::memcmp(magic, HEADER_MAGIC, MAGIC_SIZE) == 0;
+}
+
+void XR25RecordingReader::rebuild_index(size_t offset, size_t size) {
+  const unsigned char *base = _file.get_data();
+  if (_codec == CODEC_DELTA) {
+    // a truncated block at the end is ignored; only the last block may hold less than _index_interval frames
+    while (offset + BLOCK_HEADER_SIZE <= size) {
+      uint32_t payload_size = get_le32(base + offset), count = get_le32(base + offset + 4);
+      if (count == 0 || count > _index_interval || payload_size > size - offset - BLOCK_HEADER_SIZE)
+        break;
+      _index.push_back({offset, get_le64(base + offset + 8)});
+      _frame_count += count, offset += BLOCK_HEADER_SIZE + payload_size;
+      if (count < _index_interval)
+        break;
+    }
+    return;
+  }
+  // a truncated record at the end (e.g. after a crash) is ignored
+  while (offset + RECORD_HEADER_SIZE <= size && base[offset] <= XR25Deframer::MAX_FRAME_LENGTH &&
+         offset + RECORD_HEADER_SIZE + base[offset] <= size) {
+    if (_frame_count++ % _index_interval == 0)
+      _index.push_back({offset, get_le64(base + offset + 1)});
+    offset += RECORD_HEADER_SIZE + base[offset];
+  }
+}
+
+XR25RecordingReader::frame_ref XR25RecordingReader::record_at(size_t offset) const {
+  const unsigned char *p = _file.get_data() + offset;
+  return {p + RECORD_HEADER_SIZE, p[0], get_le64(p + 1)};
+}
+
+void XR25RecordingReader::decode_block(uint64_t block) {
+  const unsigned char *base = _file.get_data();
+  const size_t size = _file.get_size(), offset = _index[block].offset;
+  const uint64_t count = std::min<uint64_t>(_index_interval, _frame_count - block * _index_interval);
+  // a corrupt index or block decodes to garbage, but is never read out of bounds
+  size_t payload_size = 0;
+  uint64_t time_ns = 0;
+  if (offset <= size - BLOCK_HEADER_SIZE) {
+    payload_size = std::min<size_t>(get_le32(base + offset), size - offset - BLOCK_HEADER_SIZE);
+    time_ns = get_le64(base + offset + 8);
+  }
+
+  RangeDecoder rc(payload_size ? base + offset + BLOCK_HEADER_SIZE : base, payload_size);
+  _delta->reset(time_ns);
+  _block_data.resize(count * XR25Deframer::MAX_FRAME_LENGTH);
+  _block_frames.clear();
+  for (unsigned char *c = _block_data.data(); _block_frames.size() < count; c += XR25Deframer::MAX_FRAME_LENGTH) {
+    int length = _delta->decode(rc, c, time_ns);
+    _block_frames.push_back({c, length, time_ns});
+  }
+  _cached_block = block;
+}
+
+XR25RecordingReader::frame_ref XR25RecordingReader::get_frame(uint64_t n) {
+  if (_codec == CODEC_DELTA) {
+    if (n / _index_interval != _cached_block)
+      decode_block(n / _index_interval);
+    return _block_frames[n % _index_interval];
+  }
+
+  const unsigned char *base = _file.get_data();
+  const size_t size = _file.get_size();
+  uint64_t k;
+  size_t offset;
+  if (_cursor_frame <= n && n - _cursor_frame < _index_interval)
+    k = _cursor_frame, offset = _cursor_offset;
+  else
+    k = n - n % _index_interval, offset = _index[n / _index_interval].offset;
+  for (; k < n && offset <= size - RECORD_HEADER_SIZE; ++k)
+    offset += RECORD_HEADER_SIZE + base[offset];
+
+  // a corrupt record is never read out of bounds; it reads as an empty frame
+  if (offset > size - RECORD_HEADER_SIZE || base[offset] > XR25Deframer::MAX_FRAME_LENGTH ||
+      base[offset] > size - offset - RECORD_HEADER_SIZE) {
+    _cursor_frame = UINT64_MAX;
+    return {base, 0, 0};
+  }
+  _cursor_frame = n, _cursor_offset = offset;
+  return record_at(offset);
+}
+
+uint64_t XR25RecordingReader::find_frame(uint64_t time_ns) {
+  auto it = std::lower_bound(_index.begin(), _index.end(), time_ns,
+                             [](const XR25RecordingIndexEntry &e, uint64_t t) { return e.time_ns < t; });
+  if (it == _index.begin())
+    return 0;
+  // the first frame at or after time_ns lies between the previous index entry and *it
+  uint64_t n = (it - _index.begin() - 1) * static_cast<uint64_t>(_index_interval);
+  while (n < _frame_count && get_frame(n).time_ns < time_ns)
+    ++n;
+  return n;
+}
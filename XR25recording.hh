@@ -0,0 +1,196 @@
+/* XR25recording.hh - Indexed XR25 recording container
+ *
+ * Copyright (C) Javier Lopez-Gomez, 2016
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef XR25RECORDING_HH
+#define XR25RECORDING_HH
+
+#include "RangeCoder.hh"
+#include "XR25mmapreader.hh"
+#include "XR25streamreader.hh"
+#include "async_filebuf.hh"
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/* A recording holds unescaped frames along with their timestamps and the name of the parser that suits them.  All
+ * integers are little-endian; the layout is
+ *   header:  char magic[8] = "XR25REC1", u32 version = 2, u32 index_interval, u32 codec, char parser_t[44]
+ *   frames:  a sequence of records (CODEC_NONE) or blocks (CODEC_DELTA), see below
+ *   index:   u64 offset, u64 time_ns, of every index_interval-th frame (i.e. of the record or block that holds it)
+ *   trailer: u64 index_offset, u64 frame_count, char magic[8] = "XR25IDX1"
+ * CODEC_NONE stores each frame as a record:
+ *   u8 length, u64 time_ns, length octets (the frame, including its 0xff 0x00 header)
+ * CODEC_DELTA stores index_interval frames per block (the last block may hold fewer); blocks decode on their own:
+ *   u32 payload_size, u32 frame_count, u64 time_ns (of the first frame), payload_size octets coded by XR25DeltaCodec
+ * Version 1 recordings have no codec field, a 48-octet parser_t, and use CODEC_NONE.
+ * A recording that was not closed (e.g. after a crash) has no index nor trailer; the reader then rebuilds the index.
+ */
+struct XR25RecordingIndexEntry {
+  uint64_t offset;  /* offset of the record or block in the file */
+  uint64_t time_ns; /* timestamp of that frame */
+};
+
+enum XR25RecordingCodec : uint32_t {
+  CODEC_NONE = 0,
+  CODEC_DELTA,
+};
+
+/// Codes each frame as its difference to the previous one: consecutive frames differ in few octets, e.g. sensor values,
+/// so that the changed flag of most octets takes a fraction of a bit.  The octets that changed are coded as their
+/// (modulo 256) increment, and times as the change in the inter-frame time.  All models are adaptive and specific to
+/// the octet position; reset() should be called at the start of every block.
+class XR25DeltaCodec {
+  static constexpr int N = XR25Deframer::MAX_FRAME_LENGTH;
+
+  struct model {
+    BitModel length_changed, dt_changed, dt_sign;
+    BitTreeModel<8> length;
+    BitTreeModel<6> dt_bits;   /* bit length of the absolute change in the inter-frame time, minus 1 */
+    BitModel changed[N][2];    /* whether octet i changed, in the context of whether it did in the previous frame */
+    BitTreeModel<8> delta[N];  /* increment of octet i */
+  } _m;
+  unsigned char _prev[N];
+  unsigned char _changed[N];
+  int _length;
+  uint64_t _time_ns, _dt_ns;
+
+public:
+  /** Reset the models and the previous frame
+   * @param time_ns Time that the first frame is coded against
+   */
+  void reset(uint64_t time_ns);
+  void encode(RangeEncoder &rc, const unsigned char c[], int length, uint64_t time_ns);
+  /** Decode a frame into @a c, which should have room for XR25Deframer::MAX_FRAME_LENGTH octets
+   * @return The frame length
+   */
+  int decode(RangeDecoder &rc, unsigned char c[], uint64_t &time_ns);
+};
+
+/// Writes frames into a recording.  Frames are appended in order; the index is kept in memory and written by close().
+/// The file is written through an async_filebuf, so that write_frame() does not wait for the disk.  With CODEC_DELTA,
+/// frames are held in memory until their block is complete, so that a crash loses at most the last BLOCK_INTERVAL
+/// frames.
+class XR25RecordingWriter {
+public:
+  /// Customary file name suffix for recordings
+  static constexpr const char *FILE_SUFFIX = ".xr25";
+  /// Distance, in frames, between index entries; random access walks at most INDEX_INTERVAL - 1 records
+  static constexpr unsigned INDEX_INTERVAL = 256;
+  /// Frames per CODEC_DELTA block (about 4 seconds at the nominal rate); random access decodes a whole block
+  static constexpr unsigned BLOCK_INTERVAL = 512;
+
+private:
+  async_filebuf _buf;
+  std::ostream _os;
+  const XR25RecordingCodec _codec;
+  uint64_t _offset, _frame_count;
+  std::vector<XR25RecordingIndexEntry> _index;
+  std::unique_ptr<XR25DeltaCodec> _delta;
+  std::vector<unsigned char> _block; /* CODEC_DELTA: header and payload of the block being coded */
+  RangeEncoder _rc;
+  unsigned _block_frames;
+  uint64_t _block_time_ns;
+
+  void write_block();
+
+public:
+  /** Create a recording; throws std::system_error if the file cannot be created
+   * @param pathname Path of the new file
+   * @param parser_t Parser typename, as registered in ParserFactory, recorded in the header
+   * @param drop_when_full See async_filebuf::async_filebuf(); offline tools should pass false
+   * @param codec How frames are stored
+   */
+  XR25RecordingWriter(const std::string &pathname, const std::string &parser_t, bool drop_when_full = true,
+                      XR25RecordingCodec codec = CODEC_DELTA);
+  ~XR25RecordingWriter() { close(); }
+  XR25RecordingWriter(const XR25RecordingWriter &) = delete;
+  XR25RecordingWriter &operator=(const XR25RecordingWriter &) = delete;
+
+  /** Append a frame
+   * @param c The frame, as delivered by XR25Deframer (i.e. starting at the 0xff 0x00 header)
+   * @param length Length of @a c; at most XR25Deframer::MAX_FRAME_LENGTH
+   * @param time_ns CLOCK_MONOTONIC time, in nanoseconds, at which the frame header was read
+   */
+  void write_frame(const unsigned char c[], int length, uint64_t time_ns);
+  uint64_t get_frame_count() const { return _frame_count; }
+  bool good() const { return _os.good(); }
+  async_filebuf &get_filebuf() { return _buf; }
+
+  /// Write the pending block, the index and the trailer, and close the file; further calls have no effect
+  void close();
+};
+
+/// Random access to the frames of a memory-mapped recording.  Locating a frame by number costs one index lookup plus
+/// at most XR25RecordingWriter::INDEX_INTERVAL - 1 record skips, or decoding one block; consecutive get_frame() calls
+/// cost one skip each, or one frame decode.  Not thread-safe: get_frame() updates a cursor.
+class XR25RecordingReader {
+public:
+  struct frame_ref {
+    const unsigned char *data; /* the frame, starting at the 0xff 0x00 header */
+    int length;
+    uint64_t time_ns;
+  };
+
+private:
+  XR25MmapReader _file;
+  std::string _parser_t;
+  XR25RecordingCodec _codec;
+  unsigned _index_interval;
+  std::vector<XR25RecordingIndexEntry> _index;
+  uint64_t _frame_count;
+  uint64_t _cursor_frame; /* cursor: number and record offset of the last frame returned by get_frame() */
+  size_t _cursor_offset;
+  std::unique_ptr<XR25DeltaCodec> _delta;
+  uint64_t _cached_block; /* CODEC_DELTA: number and decoded frames of the last block accessed */
+  std::vector<unsigned char> _block_data;
+  std::vector<frame_ref> _block_frames;
+
+  frame_ref record_at(size_t offset) const;
+  void decode_block(uint64_t block);
+  /// Scan the records from @a offset up to @a size; used if the recording has no valid trailer or index
+  void rebuild_index(size_t offset, size_t size);
+
+public:
+  /** Map a recording; throws std::system_error if the file cannot be mapped or it is not a recording (EINVAL)
+   * @param pathname Path of the recording
+   */
+  XR25RecordingReader(const std::string &pathname);
+  XR25RecordingReader(const XR25RecordingReader &) = delete;
+  XR25RecordingReader &operator=(const XR25RecordingReader &) = delete;
+
+  /// Whether @a pathname starts with the recording magic; raw captures do not
+  static bool is_recording(const std::string &pathname);
+
+  const std::string &get_parser_type() const { return _parser_t; }
+  uint64_t get_frame_count() const { return _frame_count; }
+  size_t get_size() const { return _file.get_size(); }
+
+  XR25RecordingCodec get_codec() const { return _codec; }
+
+  /** Get frame number @a n; the returned pointer is valid until the next call to get_frame() or find_frame()
+   * @param n Frame number, less than get_frame_count()
+   */
+  frame_ref get_frame(uint64_t n);
+
+  /** Find the first frame recorded at or after @a time_ns
+   * @return The frame number, or get_frame_count() if none
+   */
+  uint64_t find_frame(uint64_t time_ns);
+};
+
+#endif /* XR25RECORDING_HH */
@@ -0,0 +1,226 @@
+/* XR25replay.cc - Timed replay of XR25 capture files
+ *
+ * Copyright (C) Javier Lopez-Gomez, 2016
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "XR25replay.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <endian.h>
+#include <fcntl.h>
+#include <fstream>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <system_error>
+#include <unistd.h>
+
+XR25Replay::XR25Replay(const std::string &pathname)
+    : _rec_t0(0), _duration_ns(0), _has_timestamps(0), _pipefd{-1, -1}, _wake_evfd(-1), _thrd(nullptr), _speed(1),
+      _paused(0), _stop(0), _seek_ns(-1), _position_ns(0) {
+  if (XR25RecordingReader::is_recording(pathname)) {
+    _rec = std::make_unique<XR25RecordingReader>(pathname);
+    if (uint64_t n = _rec->get_frame_count()) {
+      _rec_t0 = _rec->get_frame(0).time_ns;
+      _duration_ns = _rec->get_frame(n - 1).time_ns - _rec_t0;
+    }
+    _has_timestamps = 1;
+  } else {
+    _raw = std::make_unique<XR25MmapReader>(pathname);
+    std::ifstream ts_is(pathname + XR25TimestampRecord::TIMESTAMPS_SUFFIX, std::ios_base::binary);
+    uint64_t t0 = 0;
+    for (XR25TimestampRecord rec; ts_is.read(reinterpret_cast<char *>(&rec), sizeof(rec));) {
+      rec = {le64toh(rec.offset), le64toh(rec.time_ns)};
+      if (rec.offset >= _raw->get_size() || (!_frames.empty() && rec.offset <= _frames.back().offset))
+        break;
+      if (_frames.empty())
+        t0 = rec.time_ns;
+      // keep times monotonic, even if the sidecar was tampered with
+      uint64_t t = std::max(rec.time_ns, t0) - t0;
+      _frames.push_back({rec.offset, _frames.empty() ? t : std::max(t, _frames.back().time_ns)});
+    }
+    if (!(_has_timestamps = !_frames.empty())) {
+      // no timestamps; assume the nominal line rate
+      for (size_t h = _raw->find_header(0); h < _raw->get_size(); h = _raw->find_header(h + 2))
+        _frames.push_back(
+            {h, _frames.empty() ? 0 : (h - _frames.front().offset) * XR25TimestampRecord::NOMINAL_OCTET_NS});
+    }
+    _duration_ns = _frames.empty() ? 0 : _frames.back().time_ns;
+  }
+
+  if (pipe2(_pipefd, O_CLOEXEC) == -1 || fcntl(_pipefd[1], F_SETFL, O_NONBLOCK) == -1 ||
+      (_wake_evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+    int err = errno;
+    for (int fd : {_pipefd[0], _pipefd[1]})
+      if (fd != -1)
+        close(fd);
+    throw std::system_error(err, std::generic_category(), "XR25Replay");
+  }
+}
+
+XR25Replay::~XR25Replay() {
+  stop();
+  close(_pipefd[0]);
+  close(_pipefd[1]);
+  close(_wake_evfd);
+}
+
+size_t XR25Replay::find_frame(uint64_t time_ns) {
+  if (_rec)
+    return _rec->find_frame(_rec_t0 + time_ns);
+  return std::lower_bound(_frames.begin(), _frames.end(), time_ns,
+                          [](const XR25TimestampRecord &r, uint64_t t) { return r.time_ns < t; }) -
+         _frames.begin();
+}
+
+void XR25Replay::append_frame(size_t index) {
+  if (_rec) {
+    auto f = _rec->get_frame(index);
+    size_t n = _buf.size();
+    _buf.resize(n + 2 * f.length);
+    _buf.resize(n + XR25Deframer::escape(f.data, f.length, &_buf[n]));
+  } else {
+    const unsigned char *base = _raw->get_data();
+    size_t end = (index + 1 < _frames.size()) ? _frames[index + 1].offset : _raw->get_size();
+    _buf.insert(_buf.end(), base + _frames[index].offset, base + end);
+  }
+}
+
+void XR25Replay::wake() {
+  uint64_t v = 1;
+  while (write(_wake_evfd, &v, sizeof(v)) == -1 && errno == EINTR)
+    ;
+}
+
+bool XR25Replay::wait(int fd, short events, const struct timespec *timeout) {
+  struct pollfd pfd[] = {{_wake_evfd, POLLIN, 0}, {fd, events, 0}};
+  if (ppoll(pfd, fd == -1 ? 1 : 2, timeout, nullptr) <= 0 || !(pfd[0].revents & POLLIN))
+    return false;
+  uint64_t v;
+  while (read(_wake_evfd, &v, sizeof(v)) == -1 && errno == EINTR)
+    ;
+  return true;
+}
+
+void XR25Replay::set_speed(double speed) {
+  _speed = (speed == 0) ? 0 : std::min(std::max(speed, MIN_SPEED), MAX_SPEED);
+  wake();
+}
+
+void XR25Replay::set_paused(bool paused) {
+  _paused = paused;
+  wake();
+}
+
+void XR25Replay::seek(double position) {
+  _seek_ns = static_cast<int64_t>(std::max(position, 0.0) * 1e9);
+  wake();
+}
+
+void XR25Replay::start() {
+  if (!_thrd) {
+    _stop = 0;
+    _thrd = std::make_unique<std::thread>(&XR25Replay::replay_frames, this);
+  }
+}
+
+void XR25Replay::stop() {
+  if (_thrd) {
+    _stop = 1;
+    wake();
+    _thrd->join();
+    _thrd.reset();
+  }
+}
+
+bool XR25Replay::write_buf(bool &woken) {
+  for (size_t begin = 0; begin < _buf.size();) {
+    ssize_t n = write(_pipefd[1], &_buf[begin], _buf.size() - begin);
+    if (n > 0) {
+      begin += n;
+    } else if (n == -1 && errno == EAGAIN) {
+      // a frame is never left half-written, unless stopping
+      if (wait(_pipefd[1], POLLOUT, nullptr) && (woken = 1, _stop.load()))
+        return false;
+    } else if (n == -1 && errno != EINTR) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void XR25Replay::replay_frames() {
+  typedef std::chrono::steady_clock clock;
+  const size_t nframes = get_frame_count();
+  size_t next = 0;
+  // frames are due at `anchor_wall + (time - anchor_ns) / speed`; the anchor is reset after any request, so that
+  // speed changes, pauses and seeks do not cause a catch-up burst
+  clock::time_point anchor_wall;
+  uint64_t anchor_ns = 0;
+  double speed = 1;
+  bool reanchor = 1;
+
+  auto due = [&](uint64_t time_ns) {
+    auto d = std::chrono::nanoseconds(static_cast<int64_t>((time_ns - anchor_ns) / speed));
+    return anchor_wall + std::chrono::duration_cast<clock::duration>(d);
+  };
+
+  while (!_stop.load()) {
+    int64_t seek_ns = _seek_ns.exchange(-1);
+    if (seek_ns >= 0) {
+      next = find_frame(seek_ns);
+      _position_ns = (next < nframes) ? frame_time(next) : _duration_ns;
+      reanchor = 1;
+    }
+    if (_paused.load() || next == nframes) {
+      wait(-1, 0, nullptr);
+      reanchor = 1;
+      continue;
+    }
+    uint64_t next_ns = frame_time(next);
+    if (reanchor) {
+      anchor_wall = clock::now(), anchor_ns = next_ns, speed = _speed.load();
+      reanchor = 0;
+    }
+
+    if (speed != 0) {
+      auto now = clock::now(), when = due(next_ns);
+      if (when > now) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(when - now).count();
+        struct timespec ts = {static_cast<time_t>(ns / 1000000000), static_cast<long>(ns % 1000000000)};
+        if (wait(-1, 0, &ts))
+          reanchor = 1;
+        continue;
+      }
+    }
+
+    // write every frame that is already due in one go
+    auto now = clock::now();
+    uint64_t position_ns = next_ns;
+    _buf.clear();
+    append_frame(next);
+    while (++next < nframes && _buf.size() < MAX_WRITE_SIZE) {
+      uint64_t t = frame_time(next);
+      if (speed != 0 && due(t) > now)
+        break;
+      append_frame(next), position_ns = t;
+    }
+
+    bool woken = 0;
+    if (!write_buf(woken))
+      break;
+    _position_ns = position_ns;
+    reanchor |= woken;
+  }
+}
@@ -0,0 +1,122 @@
+/* XR25replay.hh - Timed replay of XR25 capture files
+ *
+ * Copyright (C) Javier Lopez-Gomez, 2016
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef XR25REPLAY_HH
+#define XR25REPLAY_HH
+
+#include "XR25mmapreader.hh"
+#include "XR25recording.hh"
+#include "XR25streamreader.hh"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Replay a raw capture file or a recording into a pipe, frame by frame, with the original timing.  Raw captures are
+/// paced after the timestamps sidecar (see XR25TimestampRecord) if it exists, or after the nominal line rate otherwise;
+/// frames of a recording are escaped again before they are written.  The read end of the pipe may be handed to
+/// XR25StreamReader as if it were a tty.  Speed, pause and seek requests are taken asynchronously by the replay thread,
+/// which waits on an eventfd besides the pipe.
+class XR25Replay {
+public:
+  static constexpr double MIN_SPEED = 0.25, MAX_SPEED = 64;
+  /// Upper bound for the octets written at once when several frames are due, e.g. at unthrottled speed
+  static constexpr size_t MAX_WRITE_SIZE = 1 << 16;
+
+private:
+  std::unique_ptr<XR25MmapReader> _raw;
+  std::vector<XR25TimestampRecord> _frames; /* raw captures: header offset and time (relative to the first frame) */
+  std::unique_ptr<XR25RecordingReader> _rec;
+  uint64_t _rec_t0, _duration_ns;
+  bool _has_timestamps;
+  std::vector<unsigned char> _buf; /* octets of the frames being written */
+
+  int _pipefd[2], _wake_evfd; /* replay pipe; eventfd that is signaled on speed/pause/seek/stop requests */
+  std::unique_ptr<std::thread> _thrd;
+  std::atomic<double> _speed;
+  std::atomic_bool _paused, _stop;
+  std::atomic<int64_t> _seek_ns; /* pending seek target, or -1 */
+  std::atomic<uint64_t> _position_ns;
+
+  /// Time of frame @a index, relative to the first frame
+  uint64_t frame_time(size_t index) {
+    return _rec ? _rec->get_frame(index).time_ns - _rec_t0 : _frames[index].time_ns;
+  }
+  /// Index of the first frame at or after @a time_ns, relative to the first frame
+  size_t find_frame(uint64_t time_ns);
+  /// Append the octets of frame @a index, as they were seen on the wire, to _buf
+  void append_frame(size_t index);
+
+  void wake();
+  /** Wait for @a fd to become ready for @a events, or for a wake() call
+   * @param timeout Relative timeout, or nullptr to wait indefinitely
+   * @return true if woken by a wake() call
+   */
+  bool wait(int fd, short events, const struct timespec *timeout);
+  /** Write the contents of _buf into the pipe
+   * @param woken Set if a wake() call was taken while the pipe was full
+   * @return false if stop() was called or the pipe was closed
+   */
+  bool write_buf(bool &woken);
+  void replay_frames();
+
+public:
+  /** Map a capture file and load (or compute) the time of each frame; throws std::system_error on failure
+   * @param pathname Path of the recording or raw capture file; for the latter, the timestamps are read from
+   *     `pathname` plus XR25TimestampRecord::TIMESTAMPS_SUFFIX, if present
+   */
+  XR25Replay(const std::string &pathname);
+  ~XR25Replay();
+  XR25Replay(const XR25Replay &) = delete;
+  XR25Replay &operator=(const XR25Replay &) = delete;
+
+  /// File descriptor to read the replayed stream from; it is owned by this object
+  int get_fd() const { return _pipefd[0]; }
+  bool has_timestamps() const { return _has_timestamps; }
+  size_t get_frame_count() const { return _rec ? _rec->get_frame_count() : _frames.size(); }
+
+  /// Length of the recording, in seconds
+  double get_duration() const { return _duration_ns / 1e9; }
+  /// Recording time of the last frame written, in seconds
+  double get_position() const { return _position_ns.load() / 1e9; }
+
+  double get_speed() const { return _speed.load(); }
+  /** Set the replay speed
+   * @param speed Multiplier in the range [MIN_SPEED, MAX_SPEED], or 0 to write frames as fast as they are read
+   */
+  void set_speed(double speed);
+
+  bool is_paused() const { return _paused.load(); }
+  void set_paused(bool paused);
+
+  /** Continue the replay at the first frame recorded at or after @a position
+   * @param position Recording time, in seconds
+   */
+  void seek(double position);
+
+  /** Replay frames non-blocking; call stop() to terminate thread.  The pipe is kept open after the last frame, so
+   * that it is still possible to seek backwards.
+   */
+  void start();
+
+  /** Wake up and join the internal thread; see start()
+   */
+  void stop();
+};
+
+#endif /* XR25REPLAY_HH */
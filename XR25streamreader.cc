@@ -14,12 +14,36 @@
  */
 
 #include "XR25streamreader.hh"
+#include "XR25columns.hh"
+#include "XR25recording.hh"
+#include "async_filebuf.hh"
 
-#include <condition_variable>
+#include <asm/termbits.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <endian.h>
+#include <fcntl.h>
 #include <iomanip>
-#include <mutex>
-#include <tuple>
-#include <type_traits>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <system_error>
+#include <unistd.h>
+
+XR25StreamReader::XR25StreamReader(int fd, post_parse_t p, std::ostream *tee, std::ostream *tee_timestamps,
+                                   XR25RecordingWriter *tee_recording)
+    : _fd(fd), _stop_evfd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)), _tee(tee), _tee_timestamps(tee_timestamps),
+      _tee_recording(tee_recording), _synchronized(0), _overflow_count(0), _short_frame_count(0),
+      _bad_escape_count(0), _frames_per_sec(0), _fra_count(0), _frame_offset(0), _post_parse(p), _thrd(nullptr) {
+  if (_stop_evfd == -1)
+    throw std::system_error(errno, std::generic_category(), "eventfd()");
+}
+
+XR25StreamReader::~XR25StreamReader() {
+  stop();
+  close(_stop_evfd);
+}
 
 void XR25StreamReader::start(XR25FrameParser &parser) {
   if (!_thrd)
@@ -28,8 +52,31 @@ void XR25StreamReader::start(XR25FrameParser &parser) {
 
 void XR25StreamReader::stop() {
   if (_thrd) {
-    pthread_cancel(_thrd->native_handle());
+    uint64_t v = 1;
+    while (write(_stop_evfd, &v, sizeof(v)) == -1 && errno == EINTR)
+      ;
     _thrd->join();
+    _thrd.reset();
+    // consume the wake-up, so that the reader may be started again
+    while (read(_stop_evfd, &v, sizeof(v)) == -1 && errno == EINTR)
+      ;
+  }
+}
+
+void XR25StreamReader::tty_init(int fd) {
+  struct termios2 t_io = {0, 0, CREAD | BOTHER | CS8, 0, 0, {}, 62500, 62500};
+  t_io.c_cc[VMIN] = 1;
+  ioctl(fd, TCSETS2, &t_io);
+  // O_NDELAY open() flag disables blocking mode for I/O; reenable
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+}
+
+void XR25FrameParser::parse_batch(const unsigned char *c, size_t stride, const int length[], size_t n,
+                                  XR25FrameColumns &cols, size_t first) {
+  for (size_t i = 0; i < n; ++i) {
+    XR25Frame fra{};
+    cols.valid[first + i] = parse_frame(c + i * stride, length[i], fra);
+    cols.set_row(first + i, fra);
   }
 }
 
@@ -49,48 +96,85 @@ void XR25StreamReader::frame_recv(XR25FrameParser &parser, const unsigned char c
   std::cout << std::endl;
 #endif
 
-  parser.parse_frame(c, length, fra);
-  if (_post_parse)
+  _detector.parse(parser, c, length, fra);
+  _parse_latency.record(fra.timestamp);
+  if (_post_parse) {
     _post_parse(c, length, fra);
+    _dispatch_latency.record(fra.timestamp);
+  }
+}
+
+void XR25StreamReader::write_timestamp(uint64_t offset, std::chrono::steady_clock::time_point timestamp) {
+  XR25TimestampRecord rec{htole64(offset),
+                          htole64(std::chrono::duration_cast<std::chrono::nanoseconds>(timestamp.time_since_epoch())
+                                      .count())};
+  _tee_timestamps->write(reinterpret_cast<char *>(&rec), sizeof(rec));
 }
 
 void XR25StreamReader::read_frames(XR25FrameParser &parser) {
-  unsigned char frame[128] = {0xff, 0x00}, c, *p = &frame[1];
+  typedef std::chrono::steady_clock clock;
+  unsigned char buf[READ_BLOCK_SIZE];
+  struct pollfd pfd[] = {{_fd, POLLIN, 0}, {_stop_evfd, POLLIN, 0}};
+  XR25Deframer deframer;
   XR25Frame fra{};
-  std::condition_variable term;
-  std::mutex term_m;
-  std::atomic_int count(0);
-  // thread that updates _frames_per_sec once a second
-  std::thread stat_thread([&term, &term_m, &count, this]() {
-    std::unique_lock<std::mutex> lock(term_m);
-    while (term.wait_for(lock, std::chrono::seconds(1)) == std::cv_status::timeout)
-      this->_frames_per_sec = count.exchange(0);
-  });
+  int count = 0;
+  // the raw tee drops whole blocks if the disk falls behind (see async_filebuf): timestamp records hold the offsets of
+  // frames in the file as written, and none is written for frames that lost octets, so that both stay in step
+  auto tee_buf = _tee ? dynamic_cast<async_filebuf *>(_tee->rdbuf()) : nullptr;
+  uint64_t offset = 0, raw_dropped = 0, raw_drop_end = 0;
+  auto next_stat = clock::now() + std::chrono::seconds(1);
+  _detector.reset();
 
-  // thread cancellation clean-up handler
-  typedef std::tuple<std::condition_variable &, std::thread &> arg_tuple_t;
-  auto args = std::make_tuple(std::ref(term), std::ref(stat_thread));
-  pthread_cleanup_push(
-      [](void *p) {
-        auto args = *static_cast<arg_tuple_t *>(p);
-        std::get<0>(args).notify_one();
-        std::get<1>(args).join();
-      },
-      &args);
+  for (;;) {
+    // wake up at least once a second to update _frames_per_sec
+    auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(next_stat - clock::now()).count();
+    if (poll(pfd, 2, std::max<int>(timeout, 0)) == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (pfd[1].revents)
+      break;
 
-  while (!_in.eof()) {
-    if ((c = _in.get()) == 0xff) {
-      if ((c = _in.get()) == 0x00) { /* start of frame */
-        if (_synchronized)
-          frame_recv(parser, frame, p - frame, fra), count++;
-        _synchronized = 1, p = &frame[1];
-      } else if (c != 0xff) /* translate 'ff ff' to 'ff' */
-        _in.unget();
+    if (pfd[0].revents) {
+      ssize_t n = read(_fd, buf, sizeof(buf));
+      // steady_clock is CLOCK_MONOTONIC
+      auto timestamp = clock::now();
+      if (n == 0 || (n == -1 && errno != EINTR && errno != EAGAIN))
+        break;
+      if (n > 0) {
+        if (_tee) {
+          uint64_t accepted = tee_buf ? tee_buf->get_accepted_count() : 0;
+          _tee->write(reinterpret_cast<char *>(buf), n);
+          if (tee_buf && (accepted = tee_buf->get_accepted_count() - accepted) < static_cast<uint64_t>(n))
+            raw_dropped += n - accepted, raw_drop_end = offset + n;
+        }
+        deframer.feed(
+            buf, n,
+            [&](const unsigned char c[], int length) {
+              fra.timestamp = deframer.get_frame_timestamp(), _frame_offset = deframer.get_frame_offset();
+              if (_tee_timestamps && _frame_offset >= raw_drop_end)
+                write_timestamp(_frame_offset - raw_dropped, fra.timestamp);
+              if (_tee_recording)
+                _tee_recording->write_frame(
+                    c, length,
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(fra.timestamp.time_since_epoch()).count());
+              frame_recv(parser, c, length, fra), count++;
+            },
+            timestamp);
+        offset += n;
+        if (_post_block)
+          _post_block();
+        _synchronized = deframer.is_synchronized();
+        const XR25DeframerErrors &err = deframer.get_errors();
+        _overflow_count = err.overflow, _short_frame_count = err.short_frame, _bad_escape_count = err.bad_escape;
+      }
     }
 
-    if (_synchronized)
-      static_cast<unsigned>(p - frame) < std::extent<decltype(frame)>::value ? *p++ = c
-                                                                             : (_synchronized = 0, _sync_err_count++);
+    auto now = clock::now();
+    if (now >= next_stat) {
+      _frames_per_sec = count, count = 0;
+      next_stat = now + std::chrono::seconds(1);
+    }
   }
-  pthread_cleanup_pop(1);
 }
@@ -16,11 +16,15 @@
 #ifndef XR25STREAMREADER_HH
 #define XR25STREAMREADER_HH
 
+#include "LatencyHistogram.hh"
+
 #include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
 #include <functional>
 #include <iostream>
 #include <memory>
-#include <pthread.h>
 #include <thread>
 
 enum XR25InFlags : unsigned char {
@@ -116,13 +120,59 @@ struct XR25Frame {
   int atmos_pressure;
   unsigned char afr_correction;
   int spd_km_h;
+
+  /// CLOCK_MONOTONIC time at which the header of this frame was read; not written by parsers
+  std::chrono::steady_clock::time_point timestamp;
+  /// XR25FieldMask of the fields that differ from the previous frame (see XR25ChangeDetector); not written by parsers
+  uint32_t changed;
 };
 
-/* Equivalent to '(x & bit1) ? bit2 : 0' but this is faster;
- * borrowed from include/linux/mman.h: _calc_vm_trans.
- */
-#define remap_bit(x, bit1, bit2)                                                                                       \
-  ((bit1) <= (bit2) ? ((x) & (bit1)) * ((bit2) / (bit1)) : ((x) & (bit1)) / ((bit1) / (bit2)))
+/// The fields of XR25Frame that are written by parsers, in order
+#define XR25FRAME_FIELDS(X)                                                                                            \
+  X(program_vrsn)                                                                                                      \
+  X(calib_vrsn)                                                                                                        \
+  X(in_flags)                                                                                                          \
+  X(out_flags)                                                                                                         \
+  X(map)                                                                                                               \
+  X(rpm)                                                                                                               \
+  X(throttle)                                                                                                          \
+  X(fault_flags_1)                                                                                                     \
+  X(eng_pinging)                                                                                                       \
+  X(injection_us)                                                                                                      \
+  X(advance)                                                                                                           \
+  X(fault_flags_0)                                                                                                     \
+  X(fault_fugitive)                                                                                                    \
+  X(fault_flags_2)                                                                                                     \
+  X(fault_flags_4)                                                                                                     \
+  X(fault_flags_3)                                                                                                     \
+  X(temp_water)                                                                                                        \
+  X(temp_air)                                                                                                          \
+  X(battvalue)                                                                                                         \
+  X(lambdavalue)                                                                                                       \
+  X(idle_regulation)                                                                                                   \
+  X(idle_period)                                                                                                       \
+  X(eng_pinging_delay)                                                                                                 \
+  X(atmos_pressure)                                                                                                    \
+  X(afr_correction)                                                                                                    \
+  X(spd_km_h)
+
+enum XR25FieldIndex : unsigned {
+#define X(_f) FIELD_INDEX_##_f,
+  XR25FRAME_FIELDS(X)
+#undef X
+  _FIELD_INDEX_COUNT
+};
+static_assert(_FIELD_INDEX_COUNT <= 32, "XR25FieldMask has room for 32 fields");
+
+/// One bit per field of XR25Frame, e.g. FIELD_rpm
+enum XR25FieldMask : uint32_t {
+#define X(_f) FIELD_##_f = 1u << FIELD_INDEX_##_f,
+  XR25FRAME_FIELDS(X)
+#undef X
+  FIELD_ALL = (1ull << _FIELD_INDEX_COUNT) - 1,
+};
+
+struct XR25FrameColumns;
 
 class XR25FrameParser {
 public:
@@ -133,38 +183,299 @@ public:
    * @return true if the frame @a c was parsed
    */
   virtual bool parse_frame(const unsigned char c[], int length, XR25Frame &fra) = 0;
+
+  /** Parse a batch of frames into rows [@a first, @a first + @a n) of @a cols, whose fields should be zeroed.  The
+   * default implementation calls parse_frame() for each frame.
+   * @param c Translated frames, as for parse_frame(), the i-th of which starts at `c + i * stride`
+   * @param stride Distance between frames; frames are stored in fixed-size slots so that the frame octets that a
+   *     parser reads are at a constant distance from one another
+   * @param length Length of each frame
+   * @param cols Where to write; its size() should be at least @a first + @a n
+   */
+  virtual void parse_batch(const unsigned char *c, size_t stride, const int length[], size_t n, XR25FrameColumns &cols,
+                           size_t first = 0);
+};
+
+/// Frames dropped by XR25Deframer, by cause
+struct XR25DeframerErrors {
+  int overflow;    /* longer than the nominal length, or than MAX_FRAME_LENGTH; e.g. noise hid a header */
+  int short_frame; /* shorter than the nominal length; e.g. noise looked like a header */
+  int bad_escape;  /* a 0xff data octet that was not escaped as 'ff ff' */
+
+  int total() const { return overflow + short_frame + bad_escape; }
 };
 
+/// Incremental XR25 deframer.  Raw octets are fed in blocks of arbitrary size; header and escape octets are located
+/// with memchr() so that the runs in between can be copied in bulk, and each complete frame is handed to a callback.
+/// ECUs send frames of a fixed length: once LEARN_FRAMES consecutive frames have the same length, frames of any other
+/// length are dropped, as are frames with a bad escape sequence.  The deframer synchronizes again on the next header,
+/// so that the frame that follows a glitch is not lost.
+class XR25Deframer {
+public:
+  /// Frames longer than this cause a loss of synchronization
+  static constexpr int MAX_FRAME_LENGTH = 128;
+  /// Consecutive frames of the same length after which that length is taken as the nominal one
+  static constexpr int LEARN_FRAMES = 8;
+
+private:
+  unsigned char _frame[MAX_FRAME_LENGTH] = {0xff, 0x00};
+  int _length;
+  bool _synchronized;
+  bool _pending_ff; /* last octet of the previous block was 0xff */
+  int _nominal_length; /* 0 until learned */
+  int _run_length, _run_count; /* length of the last frame, and number of consecutive frames of that length */
+  XR25DeframerErrors _errors;
+  uint64_t _offset, _frame_offset; /* octets fed before the current block; offset of the header of the frame */
+  const unsigned char *_block;
+  std::chrono::steady_clock::time_point _block_timestamp, _frame_timestamp;
+
+  void append(const unsigned char *p, int n) {
+    if (!_synchronized)
+      return;
+    if (_length + n > MAX_FRAME_LENGTH) {
+      _synchronized = 0, _errors.overflow++;
+      return;
+    }
+    std::memcpy(&_frame[_length], p, n);
+    _length += n;
+  }
+
+  /// Deliver the frame in _frame, unless its length is not the nominal one.  Frames of the wrong length still count
+  /// towards learning, so that a new nominal length is learned if the ECU changes it.
+  template <typename _F>
+  void end_frame(_F &on_frame) {
+    if (_length == _run_length) {
+      if (++_run_count >= LEARN_FRAMES)
+        _nominal_length = _length;
+    } else {
+      _run_length = _length, _run_count = 1;
+    }
+    if (_nominal_length && _length < _nominal_length)
+      _errors.short_frame++;
+    else if (_nominal_length && _length > _nominal_length)
+      _errors.overflow++;
+    else
+      on_frame(static_cast<const unsigned char *>(_frame), _length);
+  }
+
+  /** Handle the octet @a p that follows a 0xff
+   * @return Pointer to the next octet to scan
+   */
+  template <typename _F>
+  const unsigned char *unescape(const unsigned char *p, _F &on_frame) {
+    static const unsigned char ff = 0xff;
+    if (*p == 0x00) { /* start of frame */
+      if (_synchronized)
+        end_frame(on_frame);
+      _synchronized = 1, _length = 2;
+      _frame_offset = _offset + (p - _block) - 1, _frame_timestamp = _block_timestamp;
+      return p + 1;
+    }
+    if (*p == 0xff) { /* 'ff ff' is translated to 'ff' */
+      append(&ff, 1);
+      return p + 1;
+    }
+    // a lone 0xff; the octet that follows is scanned again, as it may start a header
+    if (_synchronized)
+      _synchronized = 0, _errors.bad_escape++;
+    return p;
+  }
+
+public:
+  XR25Deframer()
+      : _length(2), _synchronized(0), _pending_ff(0), _nominal_length(0), _run_length(0), _run_count(0), _errors(),
+        _offset(0), _frame_offset(0), _block(nullptr) {}
+
+  bool is_synchronized() const { return _synchronized; }
+  /// Number of frames dropped, for any cause
+  int get_sync_err_count() const { return _errors.total(); }
+  const XR25DeframerErrors &get_errors() const { return _errors; }
+  /// Nominal frame length, or 0 if not learned yet
+  int get_nominal_length() const { return _nominal_length; }
+  /// Resume learning where @a d left it, i.e. take its nominal length and its run of frames of the same length, e.g.
+  /// if @a d deframed an earlier part of the same stream
+  void learn_from(const XR25Deframer &d) {
+    _nominal_length = d._nominal_length, _run_length = d._run_length, _run_count = d._run_count;
+  }
+  /// Offset, counted from the first octet fed, of the header of the frame being delivered to `on_frame`
+  uint64_t get_frame_offset() const { return _frame_offset; }
+  /// Timestamp of the block that completed the header of the frame being delivered to `on_frame`
+  std::chrono::steady_clock::time_point get_frame_timestamp() const { return _frame_timestamp; }
+
+  /** Escape a frame for transmission, i.e. the inverse of feed(): data octets 0xff are sent as 'ff ff'
+   * @param c The frame, starting at its 0xff 0x00 header
+   * @param length Length of @a c
+   * @param out Buffer of at least 2 * @a length octets
+   * @return Number of octets written to @a out
+   */
+  static int escape(const unsigned char c[], int length, unsigned char out[]) {
+    int n = 0;
+    out[n++] = 0xff, out[n++] = 0x00;
+    for (int i = 2; i < length; ++i)
+      if ((out[n++] = c[i]) == 0xff)
+        out[n++] = 0xff;
+    return n;
+  }
+
+  /** Deframe a block of raw octets, as read from the wire
+   * @param buf Pointer to the first octet
+   * @param n Number of octets in @a buf
+   * @param on_frame Callable as `on_frame(const unsigned char c[], int length)`; called for each complete frame
+   * @param timestamp Time at which @a buf was read; see get_frame_timestamp()
+   */
+  template <typename _F>
+  void feed(const unsigned char *buf, size_t n, _F &&on_frame,
+            std::chrono::steady_clock::time_point timestamp = std::chrono::steady_clock::time_point()) {
+    const unsigned char *p = buf, *end = buf + n;
+    if (n == 0)
+      return;
+    _block = buf, _block_timestamp = timestamp;
+    if (_pending_ff)
+      _pending_ff = 0, p = unescape(p, on_frame);
+
+    while (p < end) {
+      auto q = static_cast<const unsigned char *>(std::memchr(p, 0xff, end - p));
+      if (!q) {
+        append(p, end - p);
+        break;
+      }
+      append(p, q - p);
+      if (++q == end) {
+        _pending_ff = 1;
+        break;
+      }
+      p = unescape(q, on_frame);
+    }
+    _offset += n;
+  }
+};
+
+/// Parses frames unless they are identical to the previous one, and sets XR25Frame::changed.  At idle, the ECU sends
+/// the same frame over and over: then, the parser is not called at all, and `changed` is 0.
+class XR25ChangeDetector {
+  unsigned char _last[XR25Deframer::MAX_FRAME_LENGTH];
+  int _last_length; /* -1 if no frame was parsed yet */
+
+public:
+  XR25ChangeDetector() : _last_length(-1) {}
+
+  /// Forget the previous frame, so that the next one is parsed and all its fields are flagged as changed
+  void reset() { _last_length = -1; }
+
+  /** Parse @a c into @a fra, which should hold the result of the previous call
+   * @param length Length of @a c; at most XR25Deframer::MAX_FRAME_LENGTH
+   * @return false if @a c is identical to the previous frame, i.e. @a fra was not touched but for `changed`
+   */
+  bool parse(XR25FrameParser &parser, const unsigned char c[], int length, XR25Frame &fra) {
+    if (length == _last_length && std::memcmp(c, _last, length) == 0) {
+      fra.changed = 0;
+      return false;
+    }
+    XR25Frame prev = fra;
+    parser.parse_frame(c, length, fra);
+    uint32_t changed = 0;
+#define X(_f) changed |= (fra._f != prev._f) ? FIELD_##_f : 0;
+    XR25FRAME_FIELDS(X)
+#undef X
+    fra.changed = (_last_length < 0) ? FIELD_ALL : changed;
+    std::memcpy(_last, c, length), _last_length = length;
+    return true;
+  }
+};
+
+/** Frame timestamps of a recording are stored next to the raw octet stream (by convention, in a file of the same name
+ * plus the TIMESTAMPS_SUFFIX suffix) as a sequence of these records, one per frame, in little-endian byte order.
+ */
+struct XR25TimestampRecord {
+  static constexpr const char *TIMESTAMPS_SUFFIX = ".ts";
+  /// Time taken by an octet at 62500 baud, 8N1; used to estimate the time of frames if there are no timestamps
+  static constexpr uint64_t NOMINAL_OCTET_NS = 10 * 1000000000ULL / 62500;
+
+  uint64_t offset;  /* offset of the frame header in the raw recording */
+  uint64_t time_ns; /* CLOCK_MONOTONIC time, in nanoseconds, at which the header was read */
+};
+
+class XR25RecordingWriter;
+
 class XR25StreamReader {
 private:
   typedef std::function<void(const unsigned char[], int, XR25Frame &)> post_parse_t;
+  typedef std::function<void()> post_block_t;
 
-  std::istream &_in;
+  int _fd, _stop_evfd; /* input file descriptor; eventfd that is signaled by stop() */
+  std::ostream *_tee, *_tee_timestamps;
+  XR25RecordingWriter *_tee_recording;
+  XR25ChangeDetector _detector;
   std::atomic_bool _synchronized;
-  std::atomic_int _sync_err_count, _frames_per_sec, _fra_count;
+  std::atomic_int _overflow_count, _short_frame_count, _bad_escape_count, _frames_per_sec, _fra_count;
+  uint64_t _frame_offset; /* offset of the header of the frame being passed to _post_parse */
   post_parse_t _post_parse;
+  post_block_t _post_block;
   std::unique_ptr<std::thread> _thrd;
+  LatencyHistogram _parse_latency, _dispatch_latency;
 
   void frame_recv(XR25FrameParser &parser, const unsigned char[], int, XR25Frame &);
+  void write_timestamp(uint64_t offset, std::chrono::steady_clock::time_point timestamp);
   void read_frames(XR25FrameParser &parser);
 
 public:
-  XR25StreamReader(std::istream &s, post_parse_t p = nullptr)
-      : _in(s), _synchronized(0), _sync_err_count(0), _frames_per_sec(0), _fra_count(0), _post_parse(p),
-        _thrd(nullptr) {}
-  ~XR25StreamReader() { stop(); }
+  /// Maximum number of octets that are deframed at once
+  static constexpr size_t READ_BLOCK_SIZE = 4096;
+
+  /** Construct a XR25StreamReader object; throws std::system_error if the wake-up eventfd cannot be created
+   * @param fd File descriptor to read from, e.g. a tty; it is not closed by the destructor
+   * @param p Called after a frame has been parsed; XR25Frame::changed tells which fields changed, if any
+   * @param tee If not null, octets read from @a fd are also written to this stream
+   * @param tee_timestamps If not null, a timestamp record is written to this stream for each frame; see
+   *     XR25TimestampRecord
+   * @param tee_recording If not null, frames are also appended to this recording
+   */
+  XR25StreamReader(int fd, post_parse_t p = nullptr, std::ostream *tee = nullptr,
+                   std::ostream *tee_timestamps = nullptr, XR25RecordingWriter *tee_recording = nullptr);
+  ~XR25StreamReader();
+  XR25StreamReader(const XR25StreamReader &) = delete;
+  XR25StreamReader &operator=(const XR25StreamReader &) = delete;
 
   bool is_synchronized() { return _synchronized.load(); }
-  int get_sync_err_count() { return _sync_err_count.load(); }
+  int get_sync_err_count() { return get_errors().total(); }
+  /// Frames dropped by the deframer, by cause
+  XR25DeframerErrors get_errors() {
+    return XR25DeframerErrors{_overflow_count.load(), _short_frame_count.load(), _bad_escape_count.load()};
+  }
   int get_frames_per_sec() { return _frames_per_sec.load(); }
   int get_fra_count() { return _fra_count.load(); }
+  /// Offset, counted from the first octet read, of the header of the frame being passed to the post_parse callback;
+  /// only meaningful from within it
+  uint64_t get_frame_offset() const { return _frame_offset; }
+  /// Time from the arrival of a frame header to the completion of parse_frame(), or to the detection of a frame that is
+  /// identical to the previous one
+  LatencyHistogram &get_parse_latency() { return _parse_latency; }
+  /// Time from the arrival of a frame header to the return of the post_parse callback
+  LatencyHistogram &get_dispatch_latency() { return _dispatch_latency; }
+
+  /** Set a callback that is called, from the reader thread, after the frames of each block read have been passed to
+   * post_parse, e.g. to publish what post_parse buffered before the reader waits for more input.  Should be set before
+   * start()
+   */
+  void set_post_block(post_block_t fn) { _post_block = fn; }
 
-  /** Read frames non-blocking; call stop() to cancel thread
+  /** Read frames non-blocking; call stop() to terminate thread.  The reader may be started again after stop().
    * @param parser The XR25FrameParser to use
    */
   void start(XR25FrameParser &parser);
 
-  /** Stop internal thread; see start()
+  /** Read frames in the calling thread until the end of the stream is reached
+   * @param parser The XR25FrameParser to use
+   */
+  void run(XR25FrameParser &parser) { read_frames(parser); }
+
+  /** Serial port setup: 62500 baud, 8N1, raw mode, blocking reads
+   * @param fd File descriptor of the tty
+   */
+  static void tty_init(int fd);
+
+  /** Wake up and join the internal thread; see start().  This does not rely on thread cancellation: the reader
+   * thread waits on both the input file descriptor and an eventfd, so it returns as soon as it is signaled.
    */
   void stop();
 };
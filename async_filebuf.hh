@@ -0,0 +1,190 @@
+/* async_filebuf.hh - a write-only filebuf that never waits for the disk
+ *
+ * Copyright (C) Javier Lopez-Gomez, 2016
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef ASYNC_FILEBUF_HH
+#define ASYNC_FILEBUF_HH
+
+#include "LatencyHistogram.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+/// A write-only stream buffer whose contents are written to a file by a background thread, using two buffers in turn:
+/// callers fill one buffer while the other one is written.  Callers only copy octets under a mutex that the writer
+/// thread never holds across a write(), so a slow or stalled disk cannot block them; if both buffers are full, the
+/// octets passed to a write that does not fit are dropped and counted instead (offline tools may choose to wait, see
+/// the constructor).
+/// The time taken by each write() is recorded.
+class async_filebuf : public std::streambuf {
+public:
+  /// Size of each of both buffers; at 62500 baud, this holds about 3 minutes of raw input
+  static constexpr size_t BUFFER_SIZE = 1 << 20;
+  /// Partially filled buffers are written at least this often
+  static constexpr unsigned FLUSH_INTERVAL_MS = 1000;
+
+private:
+  int _fd;
+  std::unique_ptr<char[]> _buf[2];
+  size_t _len[2];
+  unsigned _active;  /* index of the buffer being filled */
+  bool _busy;        /* the other buffer is being written */
+  bool _closing;
+  const bool _drop_when_full;
+  std::mutex _mtx;
+  std::condition_variable _cv, _cv_idle; /* signaled when a buffer is handed over; when it has been written */
+  std::unique_ptr<std::thread> _thrd;
+  std::atomic<uint64_t> _accepted_count, _written_count, _dropped_count;
+  std::atomic_bool _write_error;
+  LatencyHistogram _write_latency;
+
+  void write_all(const char *p, size_t n) {
+    while (n) {
+      ssize_t r = ::write(_fd, p, n);
+      if (r == -1 && errno == EINTR)
+        continue;
+      if (r <= 0) {
+        _write_error = 1, _dropped_count += n;
+        return;
+      }
+      p += r, n -= r, _written_count += r;
+    }
+  }
+
+  void writer_thread() {
+    std::unique_lock<std::mutex> lk(_mtx);
+    for (;;) {
+      _cv.wait_for(lk, std::chrono::milliseconds(FLUSH_INTERVAL_MS), [this]() { return _busy || _closing; });
+      if (!_busy && _len[_active])
+        _busy = 1, _active ^= 1;
+      if (!_busy) {
+        if (_closing)
+          break;
+        continue;
+      }
+
+      unsigned i = _active ^ 1;
+      lk.unlock();
+      auto t0 = std::chrono::steady_clock::now();
+      write_all(_buf[i].get(), _len[i]);
+      _write_latency.record(t0);
+      lk.lock();
+      _len[i] = 0, _busy = 0;
+      _cv_idle.notify_all();
+    }
+  }
+
+protected:
+  std::streamsize xsputn(const char *s, std::streamsize n) override {
+    std::unique_lock<std::mutex> lk(_mtx);
+    if (_fd == -1)
+      return 0;
+    // each call is all-or-nothing, unless larger than BUFFER_SIZE
+    if (_busy && _drop_when_full && static_cast<size_t>(n) > BUFFER_SIZE - _len[_active]) {
+      _dropped_count += n;
+      return n;
+    }
+    std::streamsize left = n;
+    for (;;) {
+      size_t k = std::min<size_t>(left, BUFFER_SIZE - _len[_active]);
+      std::memcpy(_buf[_active].get() + _len[_active], s, k);
+      _len[_active] += k, s += k, left -= k, _accepted_count += k;
+      if (!left)
+        break;
+      if (_busy && !_drop_when_full)
+        _cv_idle.wait(lk, [this]() { return !_busy; });
+      if (_busy)
+        break;
+      // hand the full buffer over to the writer thread
+      _busy = 1, _active ^= 1;
+      _cv.notify_one();
+    }
+    _dropped_count += left;
+    return n;
+  }
+
+  int_type overflow(int_type c) override {
+    if (traits_type::eq_int_type(c, traits_type::eof()))
+      return traits_type::not_eof(c);
+    char ch = traits_type::to_char_type(c);
+    return xsputn(&ch, 1) ? c : traits_type::eof();
+  }
+
+public:
+  /** Construct a closed async_filebuf; there is no put area, so that every write goes through xsputn()
+   * @param drop_when_full If false, writers wait for the disk when both buffers are full instead of dropping octets
+   */
+  async_filebuf(bool drop_when_full = true)
+      : _fd(-1), _len{0, 0}, _active(0), _busy(0), _closing(0), _drop_when_full(drop_when_full), _accepted_count(0),
+        _written_count(0), _dropped_count(0), _write_error(0) {}
+  ~async_filebuf() { close(); }
+  async_filebuf(const async_filebuf &) = delete;
+  async_filebuf &operator=(const async_filebuf &) = delete;
+
+  /** Create (or truncate) a file and start the writer thread
+   * @return this on success, or nullptr on failure (see errno)
+   */
+  async_filebuf *open(const std::string &pathname) {
+    if (_fd != -1 || (_fd = ::open(pathname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) == -1)
+      return nullptr;
+    for (auto &i : _buf)
+      i.reset(new char[BUFFER_SIZE]);
+    _closing = 0;
+    _thrd = std::make_unique<std::thread>(&async_filebuf::writer_thread, this);
+    return this;
+  }
+
+  bool is_open() const { return _fd != -1; }
+
+  /** Write all the buffered octets, stop the writer thread and close the file; this may wait for the disk
+   * @return false if any octet could not be written
+   */
+  bool close() {
+    if (!_thrd)
+      return 0;
+    {
+      std::lock_guard<std::mutex> lk(_mtx);
+      _closing = 1;
+    }
+    _cv.notify_one();
+    _thrd->join();
+    _thrd.reset();
+    std::lock_guard<std::mutex> lk(_mtx);
+    bool ok = ::close(_fd) == 0 && !_write_error && !_dropped_count;
+    _fd = -1;
+    return ok;
+  }
+
+  /// Octets buffered so far, i.e. the offset in the file of the next octet written, barring write errors; a writer may
+  /// compare it before and after a write to tell whether (the tail of) that write was dropped
+  uint64_t get_accepted_count() const { return _accepted_count.load(); }
+  uint64_t get_written_count() const { return _written_count.load(); }
+  /// Octets that were lost because both buffers were full or because of a write error
+  uint64_t get_dropped_count() const { return _dropped_count.load(); }
+  /// Time taken by each write() of a buffer, i.e. for how long the disk stalled the writer thread
+  LatencyHistogram &get_write_latency() { return _write_latency; }
+};
+
+#endif /* ASYNC_FILEBUF_HH */
@@ -15,20 +15,24 @@
 
 #include "Parsers.hh"
 #include "UI.hh"
+#include "XR25recording.hh"
+#include "XR25replay.hh"
 #include "XR25streamreader.hh"
-#include "tee_stdio_filebuf.hh"
+#include "async_filebuf.hh"
 
-#include <asm/termbits.h>
 #include <cstdlib>
 #include <cstring>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <gtkmm.h>
+#include <memory>
+#include <ostream>
 #include <regex>
-#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <system_error>
+#include <unistd.h>
 
 struct ParamsStruct {
   Glib::ustring dev_path;      /* tty device path */
@@ -38,6 +42,9 @@ struct ParamsStruct {
                                 * e.g., 62500,8N1 */
   Glib::ustring save_pathname; /* pathname of a file to write received
                                 * frames to */
+  Glib::ustring replay_pathname; /* if not empty, replay this capture file
+                                  * instead of reading from dev_path */
+  unsigned plot_window;          /* time span shown by plots, in seconds */
 };
 
 static constexpr const char *DEV_PATH_PREFIX = "/dev/";
@@ -49,15 +56,18 @@ static constexpr const char *DEV_PATH_PREFIX = "/dev/";
  */
 bool get_port_conf(Glib::RefPtr<Gtk::Builder> b, ParamsStruct &params) {
   Gtk::Dialog *conf_dialog;
-  Gtk::ComboBoxText *dev_path, *parser_t;
-  Gtk::Entry *tty_conf, *save_pathname;
-  Gtk::Button *save_as;
+  Gtk::ComboBoxText *dev_path, *parser_t, *plot_window;
+  Gtk::Entry *tty_conf, *save_pathname, *replay_pathname;
+  Gtk::Button *save_as, *replay_open;
   b->get_widget("conf_dialog", conf_dialog);
   b->get_widget("cd_dev_path", dev_path);
   b->get_widget("cd_parser_t", parser_t);
   b->get_widget("cd_tty_conf", tty_conf);
+  b->get_widget("cd_plot_window", plot_window);
   b->get_widget("cd_save_pathname", save_pathname);
   b->get_widget("cd_save_as", save_as);
+  b->get_widget("cd_replay_pathname", replay_pathname);
+  b->get_widget("cd_replay_open", replay_open);
 
   DIR *dirp = opendir(DEV_PATH_PREFIX);
   struct dirent *dirent;
@@ -70,7 +80,7 @@ bool get_port_conf(Glib::RefPtr<Gtk::Builder> b, ParamsStruct &params) {
 
   for (auto &i : ParserFactory::get_registered_types())
     parser_t->append(i.first);
-  parser_t->set_active(0);
+  parser_t->set_active_text("AutoDetectParser");
 
   save_as->signal_clicked().connect([conf_dialog, save_pathname, &params]() {
     Gtk::FileChooserDialog _d(*conf_dialog, "Write file:", Gtk::FILE_CHOOSER_ACTION_SAVE);
@@ -80,6 +90,13 @@ bool get_port_conf(Glib::RefPtr<Gtk::Builder> b, ParamsStruct &params) {
     if (_d.run() == Gtk::RESPONSE_OK)
       save_pathname->set_text(_d.get_filename());
   });
+  replay_open->signal_clicked().connect([conf_dialog, replay_pathname]() {
+    Gtk::FileChooserDialog _d(*conf_dialog, "Replay file:", Gtk::FILE_CHOOSER_ACTION_OPEN);
+    _d.add_button("Cancel", Gtk::RESPONSE_CANCEL);
+    _d.add_button("OK", Gtk::RESPONSE_OK);
+    if (_d.run() == Gtk::RESPONSE_OK)
+      replay_pathname->set_text(_d.get_filename());
+  });
   int ret = conf_dialog->run();
   conf_dialog->hide();
 
@@ -88,6 +105,8 @@ bool get_port_conf(Glib::RefPtr<Gtk::Builder> b, ParamsStruct &params) {
            params.parser_t = parser_t->get_active_text();
            params.tty_conf = tty_conf->get_text();
            params.save_pathname = save_pathname->get_text();
+           params.replay_pathname = replay_pathname->get_text();
+           params.plot_window = std::stoi(plot_window->get_active_id());
          }),
          ret == Gtk::RESPONSE_OK;
 }
@@ -97,40 +116,65 @@ bool get_port_conf(Glib::RefPtr<Gtk::Builder> b, ParamsStruct &params) {
  * @param conf Serial port configuration; ignored, defaults to &quot;
  *     62500,8N1&quot;
  */
-void ttyS_init(int fd, Glib::ustring conf) {
-  struct termios2 t_io = {0, 0, CREAD | BOTHER | CS8, 0, 0, {}, 62500, 62500};
-  t_io.c_cc[VMIN] = 1;
-  ioctl(fd, TCSETS2, &t_io);
-  // O_NDELAY open() flag disables blocking mode for I/O; reenable
-  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
-}
+void ttyS_init(int fd, Glib::ustring conf) { XR25StreamReader::tty_init(fd); }
 
 int main(int argc, char *argv[]) {
   auto application = Gtk::Application::create(argc, argv, "com.github.xr25_diag");
   Glib::RefPtr<Gtk::Builder> builder = Gtk::Builder::create_from_file("xr25_diag.glade");
   ParamsStruct params;
-  std::filebuf ob;
+  // captures are written by background threads, so that the reader thread never waits for the disk
+  async_filebuf ob_buf, ob_ts_buf;
+  std::ostream ob(&ob_buf), ob_ts(&ob_ts_buf);
 
   if (!get_port_conf(builder, params))
     return EXIT_SUCCESS;
 
-  int fd = open(params.dev_path.c_str(), O_RDWR | O_NOCTTY | O_NDELAY /* don't wait DCD signal */);
-  if (fd == -1) {
-    const char *err_str = g_strerror(errno);
-    Gtk::MessageDialog e("open() " + params.dev_path + " failed",
-                         /* use_markup= */ 0, Gtk::MESSAGE_ERROR);
-    e.set_secondary_text(err_str), e.run();
-    return EXIT_FAILURE;
+  std::unique_ptr<XR25Replay> replay;
+  int fd = -1;
+  if (!params.replay_pathname.empty()) {
+    try {
+      replay = std::make_unique<XR25Replay>(params.replay_pathname);
+      fd = replay->get_fd();
+    } catch (std::system_error &e) {
+      Gtk::MessageDialog d("Cannot replay " + params.replay_pathname,
+                           /* use_markup= */ 0, Gtk::MESSAGE_ERROR);
+      d.set_secondary_text(e.what()), d.run();
+      return EXIT_FAILURE;
+    }
+  } else {
+    fd = open(params.dev_path.c_str(), O_RDWR | O_NOCTTY | O_NDELAY /* don't wait DCD signal */);
+    if (fd == -1) {
+      const char *err_str = g_strerror(errno);
+      Gtk::MessageDialog e("open() " + params.dev_path + " failed",
+                           /* use_markup= */ 0, Gtk::MESSAGE_ERROR);
+      e.set_secondary_text(err_str), e.run();
+      return EXIT_FAILURE;
+    }
+    ttyS_init(fd, params.tty_conf);
   }
-  ttyS_init(fd, params.tty_conf);
 
-  if (!params.save_pathname.empty())
-    ob.open(params.save_pathname, std::ios_base::out);
-  std::unique_ptr<__gnu_cxx::stdio_filebuf<char>> filebuf(
-      ob.is_open() ? new tee_stdio_filebuf<char>(fd, std::ios_base::in, ob)
-                   : new __gnu_cxx::stdio_filebuf<char>(fd, std::ios_base::in));
-  std::istream is(filebuf.get());
+  // recordings are written if the file name has the XR25RecordingWriter::FILE_SUFFIX suffix; raw captures otherwise
+  std::unique_ptr<XR25RecordingWriter> rec;
+  const std::string save_pathname = params.save_pathname, rec_suffix = XR25RecordingWriter::FILE_SUFFIX;
+  if (save_pathname.size() > rec_suffix.size() &&
+      save_pathname.compare(save_pathname.size() - rec_suffix.size(), rec_suffix.size(), rec_suffix) == 0) {
+    try {
+      rec = std::make_unique<XR25RecordingWriter>(params.save_pathname, params.parser_t);
+    } catch (std::system_error &e) {
+      Gtk::MessageDialog d("Cannot write " + params.save_pathname,
+                           /* use_markup= */ 0, Gtk::MESSAGE_ERROR);
+      d.set_secondary_text(e.what()), d.run();
+      return EXIT_FAILURE;
+    }
+  } else if (!params.save_pathname.empty()) {
+    ob_buf.open(params.save_pathname);
+    ob_ts_buf.open(params.save_pathname + XR25TimestampRecord::TIMESTAMPS_SUFFIX);
+  }
 
-  UI(application, builder, is, *ParserFactory::create(params.parser_t)).run();
+  UI(application, builder, fd, ob_buf.is_open() ? &ob : nullptr, ob_ts_buf.is_open() ? &ob_ts : nullptr, rec.get(),
+     *ParserFactory::create(params.parser_t), params.plot_window, replay.get())
+      .run();
+  if (!replay)
+    close(fd);
   return EXIT_SUCCESS;
 }
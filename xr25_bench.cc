@@ -0,0 +1,291 @@
+/* xr25_bench.cc - benchmarks of the decode and render pipelines
+ *
+ * Copyright (C) Javier Lopez-Gomez, 2016
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "CairoGauge.hh"
+#include "CairoTSPlot.hh"
+#include "Parsers.hh"
+#include "XR25columns.hh"
+#include "XR25streamreader.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <gtkmm.h>
+#include <iterator>
+#include <map>
+#include <random>
+#include <string>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/* Output is one line of comma-separated values per benchmark, preceded by a header line:
+ *   benchmark,ns_per_op,ops_per_s,unit
+ * where `unit` is what an operation is (an octet or a frame).  Benchmark names and the order of the lines do not change
+ * between runs, so that the output of two versions can be compared with e.g. `join -t,`.  Inputs are synthetic frames
+ * generated from a fixed seed and, if found, the capture files/test_Fenix52B_32frames.data.
+ */
+
+/// Each benchmark runs for at least this long, REPEAT times; the median is reported
+static constexpr std::chrono::milliseconds MIN_TIME(200);
+static constexpr unsigned REPEAT = 5;
+/// Number of synthetic frames, and octets of each one that change from the previous one
+static constexpr unsigned SYNTHETIC_FRAMES = 4096, SYNTHETIC_CHANGES = 4;
+static constexpr int SYNTHETIC_LENGTH = 52;
+
+/** Call @a fn, which performs @a ops operations per call, repeatedly for at least MIN_TIME
+ * @return Median, over REPEAT runs, of the nanoseconds per operation
+ */
+template <typename _F>
+static double measure(_F fn, double ops) {
+  typedef std::chrono::steady_clock clock;
+  std::vector<double> ns_per_op;
+  for (unsigned r = 0; r < REPEAT; ++r) {
+    unsigned long calls = 0;
+    auto t0 = clock::now(), t = t0;
+    do
+      fn(), ++calls;
+    while ((t = clock::now()) - t0 < MIN_TIME);
+    ns_per_op.push_back(std::chrono::duration<double, std::nano>(t - t0).count() / (calls * ops));
+  }
+  std::nth_element(ns_per_op.begin(), ns_per_op.begin() + REPEAT / 2, ns_per_op.end());
+  return ns_per_op[REPEAT / 2];
+}
+
+static void report(const std::string &name, double ns_per_op, const char *unit) {
+  std::printf("%s,%.3f,%.0f,%s\n", name.c_str(), ns_per_op, 1e9 / ns_per_op, unit);
+  std::fflush(stdout);
+}
+
+/// A capture: raw octets as read from the line, and the unescaped frames
+struct capture {
+  std::string name;
+  std::vector<unsigned char> raw;
+  std::vector<std::vector<unsigned char>> frames;
+};
+
+static capture make_synthetic() {
+  capture ret{"synthetic", {}, {}};
+  std::mt19937 rng(25);
+  std::vector<unsigned char> c(SYNTHETIC_LENGTH);
+  c[0] = 0xff, c[1] = 0x00;
+  for (int i = 2; i < SYNTHETIC_LENGTH; ++i)
+    c[i] = rng();
+  for (unsigned i = 0; i < SYNTHETIC_FRAMES; ++i) {
+    for (unsigned j = 0; j < SYNTHETIC_CHANGES; ++j)
+      c[2 + rng() % (SYNTHETIC_LENGTH - 2)] = rng();
+    ret.frames.push_back(c);
+  }
+  unsigned char buf[2 * XR25Deframer::MAX_FRAME_LENGTH];
+  for (auto &i : ret.frames) {
+    int n = XR25Deframer::escape(i.data(), i.size(), buf);
+    ret.raw.insert(ret.raw.end(), buf, buf + n);
+  }
+  // a frame is delivered when the next header is seen
+  ret.raw.push_back(0xff), ret.raw.push_back(0x00);
+  return ret;
+}
+
+/** Read a raw capture file
+ * @return false if it could not be read
+ */
+static bool read_capture(const std::string &pathname, capture &cap) {
+  std::ifstream is(pathname, std::ios_base::binary);
+  if (!is)
+    return 0;
+  cap.name = pathname.substr(pathname.find_last_of('/') + 1);
+  cap.name = cap.name.substr(0, cap.name.find_last_of('.'));
+  cap.raw.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+  cap.raw.push_back(0xff), cap.raw.push_back(0x00);
+  XR25Deframer deframer;
+  deframer.feed(cap.raw.data(), cap.raw.size(),
+                [&cap](const unsigned char c[], int length) { cap.frames.emplace_back(c, c + length); });
+  return !cap.frames.empty();
+}
+
+static void bench_decode(const capture &cap) {
+  // deframing only
+  report("deframe/" + cap.name, measure([&cap]() {
+           XR25Deframer deframer;
+           deframer.feed(cap.raw.data(), cap.raw.size(), [](const unsigned char[], int) {});
+         }, cap.raw.size()),
+         "octet");
+
+  // XR25StreamReader::read_frames(), from a memory-backed file: deframing, change detection and parsing
+  int fd = memfd_create("xr25_bench", 0);
+  if (fd == -1 || write(fd, cap.raw.data(), cap.raw.size()) != static_cast<ssize_t>(cap.raw.size())) {
+    std::perror("memfd");
+    std::exit(EXIT_FAILURE);
+  }
+  auto parser = ParserFactory::create(cap.name == "synthetic" ? "Fenix3Parser" : "Fenix52BParser");
+  XR25StreamReader reader(fd);
+  report("read_frames/" + cap.name, measure([&]() {
+           lseek(fd, 0, SEEK_SET);
+           reader.run(*parser);
+         }, cap.raw.size()),
+         "octet");
+  close(fd);
+
+  // parsers, frame by frame and in batches; in order of typename
+  std::vector<unsigned char> slots(cap.frames.size() * XR25Deframer::MAX_FRAME_LENGTH);
+  std::vector<int> length;
+  for (size_t i = 0; i < cap.frames.size(); ++i) {
+    std::copy(cap.frames[i].begin(), cap.frames[i].end(), &slots[i * XR25Deframer::MAX_FRAME_LENGTH]);
+    length.push_back(cap.frames[i].size());
+  }
+  // batches as large as those of XR25MmapReader
+  static constexpr size_t BATCH = 64;
+  XR25FrameColumns cols;
+  cols.resize(BATCH);
+  std::map<std::string, ParserFactory::parser_ptr_t> parsers;
+  for (auto &i : ParserFactory::get_registered_types())
+    parsers[i.first] = i.second();
+  for (auto &i : parsers) {
+    XR25FrameParser &p = *i.second;
+    report("parse_frame/" + i.first + "/" + cap.name, measure([&]() {
+             XR25Frame fra{};
+             for (auto &f : cap.frames)
+               p.parse_frame(f.data(), f.size(), fra);
+           }, cap.frames.size()),
+           "frame");
+    report("parse_batch/" + i.first + "/" + cap.name, measure([&]() {
+             for (size_t j = 0; j < length.size(); j += BATCH)
+               p.parse_batch(&slots[j * XR25Deframer::MAX_FRAME_LENGTH], XR25Deframer::MAX_FRAME_LENGTH, &length[j],
+                             std::min(BATCH, length.size() - j), cols);
+           }, cap.frames.size()),
+           "frame");
+  }
+}
+
+/// Exposes on_draw(), so that widgets can be painted into an image surface
+template <typename _W>
+struct offscreen_widget : public _W {
+  using _W::_W;
+  using _W::on_draw;
+};
+
+/** Render benchmarks; widgets are realized in an offscreen window, and painted into an image surface of the same size
+ */
+static void bench_render(const capture &cap) {
+  static constexpr int WIDTH = 640, HEIGHT = 320;
+  std::vector<XR25Frame> frames(cap.frames.size());
+  auto parser = ParserFactory::create("Fenix3Parser");
+  for (size_t i = 0; i < cap.frames.size(); ++i)
+    parser->parse_frame(cap.frames[i].data(), cap.frames[i].size(), frames[i]);
+
+  offscreen_widget<CairoTSPlot> plot("RPM",
+                                     [](void *p, bool &is_alerted) {
+                                       is_alerted = static_cast<XR25Frame *>(p)->rpm > 5000;
+                                       return static_cast<XR25Frame *>(p)->rpm;
+                                     },
+                                     0, 8000, 1000, FIELD_rpm);
+  offscreen_widget<CairoTSPlot> long_plot(plot);
+  offscreen_widget<CairoGauge> gauge("RPM", [](void *p) { return static_cast<XR25Frame *>(p)->rpm; }, 8000, 500, 2,
+                                     FIELD_rpm);
+  TSHistory history;
+  plot.set_history(history);
+  Gtk::Box box;
+  Gtk::OffscreenWindow window;
+  plot.set_size_request(WIDTH, HEIGHT), long_plot.set_size_request(WIDTH, HEIGHT);
+  gauge.set_size_request(HEIGHT, HEIGHT);
+  box.pack_start(plot), box.pack_start(long_plot), box.pack_start(gauge);
+  window.add(box);
+  window.show_all();
+  while (Gtk::Main::events_pending())
+    Gtk::Main::iteration();
+
+  // frames arrive at about the nominal rate of 52-octet frames
+  auto t = std::chrono::steady_clock::now();
+  const auto period = std::chrono::microseconds(8320);
+  size_t i = 0;
+  report("CairoTSPlot/sample", measure([&]() {
+           for (auto &f : frames)
+             plot.sample(&f), history.push(t += period);
+         }, frames.size()),
+         "frame");
+
+  auto surface = Cairo::ImageSurface::create(Cairo::FORMAT_ARGB32, WIDTH, HEIGHT);
+  report("CairoTSPlot/on_draw", measure([&]() {
+           plot.sample(&frames[i++ % frames.size()]), history.push(t += period);
+           plot.on_draw(Cairo::Context::create(surface));
+         }, 1),
+         "frame");
+
+  // a 2-hour window, read from the rollups; its cost should be that of the 30-second one
+  static constexpr unsigned LONG_WINDOW_S = 7200;
+  TSHistory long_history(1 << 16);
+  long_plot.set_history(long_history, LONG_WINDOW_S);
+  for (unsigned j = 0; j < LONG_WINDOW_S * std::chrono::seconds(1) / period; ++j)
+    long_plot.sample(&frames[j % frames.size()]), long_history.push(t += period);
+  long_plot.on_draw(Cairo::Context::create(surface));
+  report("CairoTSPlot/on_draw/2h", measure([&]() {
+           long_plot.sample(&frames[i++ % frames.size()]), long_history.push(t += period);
+           long_plot.on_draw(Cairo::Context::create(surface));
+         }, 1),
+         "frame");
+
+  // samples pushed from another thread at STRESS_RATE while the plot is painted; `make check` checks that no sample is
+  // read back torn
+  static constexpr unsigned STRESS_RATE = 100000;
+  TSHistory stress_history(1 << 16);
+  long_plot.set_history(stress_history, CairoTSPlot::DEFAULT_WINDOW_S);
+  std::atomic_bool stop(false);
+  std::thread producer([&]() {
+    auto t = std::chrono::steady_clock::now();
+    const auto stress_period = std::chrono::nanoseconds(1000000000 / STRESS_RATE);
+    for (size_t j = 0; !stop; ++j) {
+      long_plot.sample(&frames[j % frames.size()]), stress_history.push(t += stress_period);
+      if (j % 64 == 0)
+        std::this_thread::sleep_until(t);
+    }
+  });
+  report("CairoTSPlot/on_draw/stress", measure([&]() { long_plot.on_draw(Cairo::Context::create(surface)); }, 1),
+         "frame");
+  stop = true;
+  producer.join();
+
+  report("CairoGauge/on_draw", measure([&]() {
+           gauge.update(&frames[i++ % frames.size()], t);
+           gauge.on_draw(Cairo::Context::create(surface));
+         }, 1),
+         "frame");
+}
+
+int main(int argc, char *argv[]) {
+  const std::string capture_pathname = (argc > 1) ? argv[1] : "files/test_Fenix52B_32frames.data";
+  std::vector<capture> captures{make_synthetic()};
+  captures.emplace_back();
+  if (!read_capture(capture_pathname, captures.back())) {
+    std::fprintf(stderr, "%s: cannot read %s; skipped\n", argv[0], capture_pathname.c_str());
+    captures.pop_back();
+  }
+
+  std::printf("benchmark,ns_per_op,ops_per_s,unit\n");
+  for (auto &i : captures)
+    bench_decode(i);
+
+  // widgets need a display, even if painted offscreen
+  if (!gtk_init_check(&argc, &argv)) {
+    std::fprintf(stderr, "%s: no display; render benchmarks skipped\n", argv[0]);
+    return EXIT_SUCCESS;
+  }
+  Gtk::Main::init_gtkmm_internals();
+  bench_render(captures.front());
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,92 @@
+/* xr25_check.cc - checks that do not need a display
+ *
+ * Copyright (C) Javier Lopez-Gomez, 2016
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "TSHistory.hh"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+/* Output is one line per check, `<check>: <details>: ok|FAILED`; the exit status is non-zero if any check failed.
+ */
+
+/// Samples pushed by the producer, at virtual intervals of SAMPLE_PERIOD, i.e. a few minutes so that all the rollup
+/// levels wrap around; and number of consumer threads
+static constexpr uint64_t STRESS_SAMPLES = 1 << 24;
+static constexpr std::chrono::microseconds SAMPLE_PERIOD(20);
+static constexpr unsigned STRESS_CONSUMERS = 2;
+/// Values are in [0, VALUE_RANGE); samples above ALERT_THRESHOLD are alerted
+static constexpr unsigned VALUE_RANGE = 8000, ALERT_THRESHOLD = 5000;
+
+/// Value of sample @a n
+static float value_of(uint64_t n) { return (n * 7919) % VALUE_RANGE; }
+
+/** One thread pushes samples to a TSHistory as fast as it can, while others read back every published entry of every
+ * level.  An entry is torn if its alert state does not match its maximum (a rollup is alerted iff any of its samples
+ * is, i.e. iff its maximum is above ALERT_THRESHOLD) or, for samples, if its value is not the one pushed at its time.
+ * @return Whether no torn entry was read
+ */
+static bool check_tshistory_stress() {
+  TSHistory history(1 << 16);
+  const unsigned ch = history.add_channel();
+  const TSHistory::clock::time_point t0(std::chrono::hours(1));
+  std::atomic_bool stop(false);
+  std::atomic<uint64_t> reads(0), torn(0);
+
+  auto consumer = [&]() {
+    uint64_t r = 0, bad = 0;
+    while (!stop)
+      for (unsigned l = 0; l <= TSHistory::LEVELS; ++l)
+        for (uint64_t n = history.get_first(l), head = history.get_head(l); n < head; ++n) {
+          TSHistory::entry e;
+          if (!history.read(ch, n, l, e) || std::isnan(e.max))
+            continue;
+          r++;
+          if (e.is_alerted != (e.max > ALERT_THRESHOLD) || e.min > e.max)
+            bad++;
+          else if (l == 0 && e.max != value_of((e.time - t0) / SAMPLE_PERIOD))
+            bad++;
+        }
+    reads += r, torn += bad;
+  };
+  std::vector<std::thread> consumers;
+  for (unsigned i = 0; i < STRESS_CONSUMERS; ++i)
+    consumers.emplace_back(consumer);
+
+  for (uint64_t n = 0; n < STRESS_SAMPLES; ++n) {
+    float v = value_of(n);
+    history.set(ch, v, v > ALERT_THRESHOLD);
+    history.push(t0 + n * SAMPLE_PERIOD);
+  }
+  history.publish();
+  stop = true;
+  for (auto &i : consumers)
+    i.join();
+
+  std::printf("TSHistory/stress: %llu samples, %llu reads, %llu torn: %s\n",
+              static_cast<unsigned long long>(STRESS_SAMPLES), static_cast<unsigned long long>(reads.load()),
+              static_cast<unsigned long long>(torn.load()), torn ? "FAILED" : "ok");
+  return torn == 0;
+}
+
+int main() {
+  bool ok = true;
+  ok &= check_tshistory_stress();
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
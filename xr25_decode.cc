@@ -0,0 +1,347 @@
+/* xr25_decode.cc - decode a raw XR25 capture file without the user interface
+ *
+ * Copyright (C) Javier Lopez-Gomez, 2016
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "Parsers.hh"
+#include "XR25columns.hh"
+#include "XR25mmapreader.hh"
+#include "XR25multireader.hh"
+#include "XR25recording.hh"
+#include "XR25streamreader.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <endian.h>
+#include <fcntl.h>
+#include <fstream>
+#include <signal.h>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+#include <unistd.h>
+
+/// Row @a i of a batch of frames, written by write_csv() and write_bin() in the same way as an XR25Frame
+struct column_row {
+  const XR25FrameColumns &cols;
+  size_t i;
+};
+
+#define X(_f)                                                                                                          \
+  static inline auto get_##_f(const XR25Frame &fra) { return fra._f; }                                                 \
+  static inline auto get_##_f(const column_row &r) { return r.cols._f[r.i]; }
+XR25FRAME_FIELDS(X)
+#undef X
+
+/** Write a frame as a line of comma-separated values: frame number, timestamp, and XR25FRAME_FIELDS in order
+ */
+template <typename _Row>
+static void write_csv(std::ostream &os, unsigned long frame_no, uint64_t time_ns, const _Row &fra) {
+  os << frame_no << ',' << time_ns;
+#define X(_f) os << ',' << +get_##_f(fra);
+  XR25FRAME_FIELDS(X)
+#undef X
+  os << '\n';
+}
+
+/** Write a frame as a fixed-width binary record: a 32-bit frame number and a 64-bit timestamp followed by one 32-bit
+ * field per column (in the same order as the CSV output); integer fields are written as int32_t, floating-point fields
+ * as IEEE-754 single precision.  All values are little-endian.
+ */
+template <typename _Row>
+static void write_bin(std::ostream &os, unsigned long frame_no, uint64_t time_ns, const _Row &fra) {
+  auto put_u32 = [](unsigned char *&p, uint32_t v) {
+    v = htole32(v);
+    std::memcpy(p, &v, sizeof(v)), p += sizeof(v);
+  };
+  auto put = [&put_u32](unsigned char *&p, auto v) {
+    uint32_t u;
+    if (std::is_floating_point<decltype(v)>::value) {
+      float f = v;
+      std::memcpy(&u, &f, sizeof(u));
+    } else
+      u = static_cast<int32_t>(v);
+    put_u32(p, u);
+  };
+  unsigned char rec[4 * 64], *p = rec;
+
+  put_u32(p, frame_no);
+  put_u32(p, time_ns), put_u32(p, time_ns >> 32);
+#define X(_f) put(p, get_##_f(fra));
+  XR25FRAME_FIELDS(X)
+#undef X
+  os.write(reinterpret_cast<char *>(rec), p - rec);
+}
+
+/// If @a parser is an AutoDetectParser, tell which parser it locked onto
+static void report_detected(const XR25FrameParser &parser) {
+  if (auto p = dynamic_cast<const AutoDetectParser *>(&parser)) {
+    std::string type = p->get_detected_type();
+    std::cerr << "Detected parser: " << (type.empty() ? "none (too few distinct frames)" : type) << std::endl;
+  }
+}
+
+static void usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0 << " [-p parser] [-f csv|bin|rec|raw] [-c codec] [-o output] [-j threads]"
+            << " [-s seconds] <file>\n"
+            << "       " << argv0 << " [-p parser] [-f csv|bin] [-o output] <tty|pipe> <tty|pipe>...\n"
+            << "  -p  Parser typename (default: the one stored in a recording, or Fenix3Parser); one of:";
+  for (auto &i : ParserFactory::get_registered_types())
+    std::cerr << " " << i.first;
+  std::cerr << "\n  -f  Output format: comma-separated values (default), fixed-width binary records, or a conversion\n"
+            << "      of the input to an indexed recording (rec) or to a raw capture plus its .ts file (raw)\n"
+            << "  -c  Frame coding of a recording: delta (compressed, default) or none\n"
+            << "  -o  Output file (default: standard output; required by rec and raw)\n"
+            << "  -j  Memory-map a raw capture file and decode it using this number of threads\n"
+            << "  -s  Start at this time, in seconds since the first frame (recordings only)\n"
+            << "The input file may be either a raw capture or a recording (see the -f option).\n"
+            << "If several inputs are given, they are read at the same time until interrupted (SIGINT/SIGTERM) or until\n"
+            << "all of them reach their end; a leading column (or 32-bit field) holds the index of the input.\n";
+}
+
+int main(int argc, char *argv[]) {
+  std::string parser_t = "Fenix3Parser", format = "csv", codec = "delta", out_pathname;
+  int opt, nthreads = 0;
+  bool parser_given = 0;
+  double start_s = 0;
+
+  while ((opt = getopt(argc, argv, "p:f:c:o:j:s:h")) != -1) {
+    switch (opt) {
+    case 'p':
+      parser_t = optarg, parser_given = 1;
+      break;
+    case 'f':
+      format = optarg;
+      break;
+    case 'c':
+      codec = optarg;
+      break;
+    case 'o':
+      out_pathname = optarg;
+      break;
+    case 'j':
+      nthreads = std::atoi(optarg);
+      break;
+    case 's':
+      start_s = std::atof(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  const bool is_multi = argc - optind > 1, is_conversion = (format == "rec" || format == "raw");
+  const bool is_recording = optind < argc && !is_multi && XR25RecordingReader::is_recording(argv[optind]);
+  if (optind == argc || (is_multi && nthreads) || nthreads < 0 || start_s < 0 ||
+      (format != "csv" && format != "bin" && !is_conversion) || (codec != "delta" && codec != "none") ||
+      (is_conversion && (is_multi || nthreads || out_pathname.empty())) || (is_recording && nthreads) ||
+      (!is_recording && start_s != 0)) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::unique_ptr<XR25RecordingReader> rec_in;
+  std::unique_ptr<XR25RecordingWriter> rec_out;
+  try {
+    if (is_recording) {
+      rec_in = std::make_unique<XR25RecordingReader>(argv[optind]);
+      if (!parser_given && ParserFactory::get_registered_types().count(rec_in->get_parser_type()))
+        parser_t = rec_in->get_parser_type();
+    }
+    if (!ParserFactory::get_registered_types().count(parser_t)) {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    if (format == "rec")
+      rec_out = std::make_unique<XR25RecordingWriter>(out_pathname, parser_t, /* drop_when_full= */ false,
+                                                      (codec == "none") ? CODEC_NONE : CODEC_DELTA);
+  } catch (const std::system_error &e) {
+    std::cerr << argv[0] << ": " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::ios_base::sync_with_stdio(false);
+  std::ofstream of, ts_of;
+  if (!out_pathname.empty() && !rec_out) {
+    of.open(out_pathname, std::ios_base::out | std::ios_base::binary);
+    if (format == "raw")
+      ts_of.open(out_pathname + XR25TimestampRecord::TIMESTAMPS_SUFFIX, std::ios_base::out | std::ios_base::binary);
+    if (!of.is_open() || (format == "raw" && !ts_of.is_open())) {
+      std::cerr << argv[0] << ": cannot open " << out_pathname << ": " << std::strerror(errno) << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  std::ostream &os = of.is_open() ? of : std::cout;
+
+  // timestamps, if the raw capture was recorded along with them
+  std::vector<XR25TimestampRecord> timestamps;
+  std::ifstream ts_is(argv[optind] + std::string(XR25TimestampRecord::TIMESTAMPS_SUFFIX), std::ios_base::binary);
+  for (XR25TimestampRecord rec; !is_recording && ts_is.read(reinterpret_cast<char *>(&rec), sizeof(rec));)
+    timestamps.push_back({le64toh(rec.offset), le64toh(rec.time_ns)});
+  if (is_conversion && !is_recording && timestamps.empty()) {
+    // conversions keep the timing of the frames; assume the nominal line rate
+    try {
+      XR25MmapReader reader(argv[optind]);
+      for (size_t h = reader.find_header(0); h < reader.get_size(); h = reader.find_header(h + 2))
+        timestamps.push_back({h, h * XR25TimestampRecord::NOMINAL_OCTET_NS});
+    } catch (const std::system_error &e) {
+      std::cerr << argv[0] << ": " << e.what() << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  unsigned long frame_no = 0;
+  uint64_t raw_offset = 0;
+  auto write_fn = (format == "csv") ? write_csv<XR25Frame> : write_bin<XR25Frame>;
+  // the deframer may drop frames, so frames are matched to timestamps by the offset of their header
+  auto frame_time = [&](uint64_t offset) {
+    auto i = std::lower_bound(timestamps.begin(), timestamps.end(), offset,
+                              [](const XR25TimestampRecord &r, uint64_t o) { return r.offset < o; });
+    return (i != timestamps.end() && i->offset == offset) ? i->time_ns : 0;
+  };
+  // @a c and @a l are only used by conversions
+  auto emit = [&](const unsigned char c[], int l, uint64_t time_ns, const XR25Frame &fra) {
+    if (rec_out) {
+      rec_out->write_frame(c, l, time_ns);
+    } else if (format == "raw") {
+      unsigned char buf[2 * XR25Deframer::MAX_FRAME_LENGTH];
+      int n = XR25Deframer::escape(c, l, buf);
+      XR25TimestampRecord rec{htole64(raw_offset), htole64(time_ns)};
+      os.write(reinterpret_cast<char *>(buf), n);
+      ts_of.write(reinterpret_cast<char *>(&rec), sizeof(rec));
+      raw_offset += n;
+    } else {
+      write_fn(os, frame_no, time_ns, fra);
+    }
+    frame_no++;
+  };
+  auto emit_port = [&](unsigned port, const XR25Frame &fra) {
+    uint32_t le_port = htole32(port);
+    if (format == "csv")
+      os << port << ',';
+    else
+      os.write(reinterpret_cast<char *>(&le_port), sizeof(le_port));
+    write_fn(os, frame_no++,
+             std::chrono::duration_cast<std::chrono::nanoseconds>(fra.timestamp.time_since_epoch()).count(), fra);
+  };
+  if (format == "csv") {
+    os << (is_multi ? "port,frame,time_ns" : "frame,time_ns");
+#define X(_f) os << "," #_f;
+    XR25FRAME_FIELDS(X)
+#undef X
+    os << '\n';
+  }
+
+  auto t0 = std::chrono::steady_clock::now();
+  size_t in_size = 0;
+  int sync_err_count = 0;
+  XR25DeframerErrors errors{}; /* single input only */
+  if (is_multi) {
+    std::vector<int> fds;
+    sigset_t set;
+    sigemptyset(&set), sigaddset(&set, SIGINT), sigaddset(&set, SIGTERM);
+    // signals are taken synchronously by this thread; the reader thread inherits the mask
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    try {
+      XR25MultiReader reader([&](unsigned port, const unsigned char c[], int l, XR25Frame &fra) { emit_port(port, fra); });
+      for (int i = optind; i < argc; ++i) {
+        int fd = open(argv[i], O_RDONLY | O_NOCTTY);
+        if (fd == -1)
+          throw std::system_error(errno, std::generic_category(), argv[i]);
+        fds.push_back(fd);
+        if (isatty(fd))
+          XR25StreamReader::tty_init(fd);
+        reader.add_port(fd, ParserFactory::create(parser_t));
+      }
+
+      const struct timespec poll_interval = {0, 100000000};
+      reader.start();
+      while (reader.is_running() && sigtimedwait(&set, nullptr, &poll_interval) == -1)
+        ;
+      reader.stop();
+      for (unsigned i = 0; i < reader.get_port_count(); ++i)
+        sync_err_count += reader.get_sync_err_count(i);
+    } catch (const std::system_error &e) {
+      std::cerr << argv[0] << ": " << e.what() << std::endl;
+      return EXIT_FAILURE;
+    }
+    for (auto fd : fds)
+      close(fd);
+  } else if (rec_in) {
+    auto parser = ParserFactory::create(parser_t);
+    XR25ChangeDetector detector;
+    XR25Frame fra{};
+    uint64_t n = 0, count = rec_in->get_frame_count();
+    if (start_s > 0 && count)
+      n = rec_in->find_frame(rec_in->get_frame(0).time_ns + static_cast<uint64_t>(start_s * 1e9));
+    for (; n < count; ++n) {
+      auto f = rec_in->get_frame(n);
+      detector.parse(*parser, f.data, f.length, fra);
+      emit(f.data, f.length, f.time_ns, fra);
+    }
+    in_size = rec_in->get_size();
+    report_detected(*parser);
+  } else if (nthreads) {
+    try {
+      XR25MmapReader reader(argv[optind]);
+      auto write_row = (format == "csv") ? write_csv<column_row> : write_bin<column_row>;
+      reader.decode(parser_t, nthreads, [&](unsigned long, const XR25FrameColumns &cols) {
+        for (size_t i = 0; i < cols.size(); ++i, ++frame_no)
+          write_row(os, frame_no, frame_time(cols.offset[i]), column_row{cols, i});
+      });
+      in_size = reader.get_size(), errors = reader.get_errors(), sync_err_count = errors.total();
+      report_detected(reader.get_parser());
+    } catch (const std::system_error &e) {
+      std::cerr << argv[0] << ": " << e.what() << std::endl;
+      return EXIT_FAILURE;
+    }
+  } else {
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd == -1) {
+      std::cerr << argv[0] << ": cannot open " << argv[optind] << ": " << std::strerror(errno) << std::endl;
+      return EXIT_FAILURE;
+    }
+    auto parser = ParserFactory::create(parser_t);
+    XR25StreamReader reader(fd, [&](const unsigned char c[], int l, XR25Frame &fra) {
+      emit(c, l, frame_time(reader.get_frame_offset()), fra);
+    });
+    reader.run(*parser);
+    in_size = lseek(fd, 0, SEEK_END), errors = reader.get_errors(), sync_err_count = errors.total();
+    report_detected(*parser);
+    close(fd);
+  }
+  if (format == "raw") {
+    // a frame is delivered when the next header is seen; terminate the last one
+    static const char header[] = {'\xff', '\x00'};
+    os.write(header, sizeof(header));
+  }
+  os.flush();
+  if (rec_out)
+    rec_out->close();
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+  std::cerr << frame_no << " frames decoded, " << sync_err_count << " sync errors";
+  if (errors.total())
+    std::cerr << " (" << errors.overflow << " overflow, " << errors.short_frame << " short, " << errors.bad_escape
+              << " bad escape)";
+  std::cerr << "; " << elapsed.count() << " s ("
+            << in_size / 1e6 / elapsed.count() << " MB/s)" << std::endl;
+  return (os.good() && (!rec_out || rec_out->good()) && (format != "raw" || ts_of.good())) ? EXIT_SUCCESS
+                                                                                         : EXIT_FAILURE;
+}